@@ -9,8 +9,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <limits.h>
+#include <netinet/in.h>
 
 #include "klfer_api.h"
+#include "klfer_reader.h"
+#include "klfer_top.h"
+#include "klfer_export.h"
+#include "klfer_elf.h"
 
 #define APP "klferctl"
 #define APP_VERSION "0.4"
@@ -18,6 +25,19 @@
 #define DEVICE_FILE_PATH ("/dev/" KLFER_DEVICE_NAME)
 #define ARG_REQ(s) (strcmp(s, argv[1]) == 0)
 #define KLFER_NO_COMMAND -1
+#define KLFER_OUTPUT_LOGS -2 // Not ioctl: read logs and decode them in application
+#define DEFAULT_WINDOW_MS 100
+#define KLFER_TOP -3         // Not ioctl: live view of per-function counters
+#define KLFER_ARM -4         // Not ioctl: function names are converted to indexes for KLFER_ARM_FUNCS
+#define KLFER_EXPORT -5      // Not ioctl: per-function counters in Prometheus text format
+#define DEFAULT_EXPORT_SEC 15.0
+#define DEFAULT_SESSION_NAME "default"
+
+/* Comma separated function names of -a / -x */
+struct arm_lists {
+    char *arm;
+    char *disarm;
+};
 
 /**
  * Usage
@@ -25,22 +45,55 @@
 static void usage(void)
 {
     printf("Usage:\n");
-    printf("  %s {-A <FUNC>|-D <FUNC>|-R|{[-E|-d] [-J|-j] [-T<FMT>|-t]}|-S|-L|-h}\n\n", APP);
+    printf("  %s [-N <NAME>] {-A <FUNC> [-u <NSEC>] [-q <PCT>]|-D <FUNC>|-R|{[-E|-d] [-J|-j] [-T<FMT>|-t] [-C|-c] [-P|-p] [-V|-v]}|-M <LOOPS>|-K <RATE>|-k|{[-a <FUNCS>] [-x <FUNCS>]}|-B <SIZE>|-S|-L|-O [-F [-W <MSEC>]]|-h}\n\n", APP);
+    printf("    -N <NAME>     Select tracing session(*4) <NAME> (default: \"default\")\n");
     printf("    -A <FUNC>     Add new function(<FUNC>(*1)) to be registered\n");
+    printf("    -u <NSEC>     Log paired-call record of <FUNC> only if it takes <NSEC> nsec or longer (with -A)\n");
+    printf("    -q <PCT>      Reserve <PCT>%% of log buffer per CPU for <FUNC>(*13) (with -A)\n");
     printf("    -D <FUNC>     Delete registered function(<FUNC>(*1))\n");
     printf("    -R            Reset (delete all registered functions and logs)\n");
     printf("    -E | -d       Enable logger(-E) / Disable logger(-d) (default: Disable)\n");
     printf("    -J | -j       Enable JIT print log(*3)(-J) / Disable JIT print log(-j) (default: Disable)\n");
     printf("    -T<FMT> | -t  Enable Timestamp(-T<FMT>(*2)) / Disable Timestamp(-t) (default: Enable)\n");
+    printf("    -C | -c       Enable compact log format(*5)(-C) / Disable compact log format(-c) (default: Disable)\n");
+    printf("    -P | -p       Enable paired-call record(*7)(-P) / Disable paired-call record(-p) (default: Disable)\n");
+    printf("    -V | -v       Enable overhead subtraction(*12)(-V) / Disable overhead subtraction(-v) (default: Disable)\n");
+    printf("    -M <LOOPS>    Measure probe overhead(*12) with <LOOPS> calls of an empty function on each CPU\n");
+    printf("    -K <RATE>|-k  Enable stack capture(*9) of 1 of <RATE> calls(-K) / Disable stack capture(-k) (default: Disable)\n");
+    printf("    -a <FUNCS>    Arm registered functions(*11) (<FUNCS>: comma separated names)\n");
+    printf("    -x <FUNCS>    Disarm registered functions(*11) (<FUNCS>: comma separated names)\n");
+    printf("    -B <SIZE>     Resize log buffer of each CPU to <SIZE>(*6) bytes (logs are deleted)\n");
     printf("    -S            Dump current settings and registered functions\n");
     printf("    -L            Dump Logs\n");
+    printf("    -O            Output Logs to stdout (decoded by %s)\n", APP);
+    printf("    -F            Follow new logs until interrupted (with -O)(*10)\n");
+    printf("    -W <MSEC>     Reorder window of -F (default: %d)\n", DEFAULT_WINDOW_MS);
     printf("    -h            Help\n\n");
+    printf("  %s top [-N <NAME>] [-d <SEC>] [-n <COUNT>]\n\n", APP);
+    printf("    Live view of calls/sec, average / max latency and time share of registered functions(*8)\n");
+    printf("    -N <NAME>     Select tracing session <NAME> (default: \"default\")\n");
+    printf("    -d <SEC>      Refresh interval (default: 1.0)\n");
+    printf("    -n <COUNT>    Exit after <COUNT> refreshes (default: until interrupted)\n\n");
+    printf("  %s export [-N <NAME>] {-o <FILE> [-d <SEC>]|-p [<ADDR>:]<PORT>} [-n <COUNT>]\n\n", APP);
+    printf("    Export counters of registered functions(*8) in Prometheus text format\n");
+    printf("    -N <NAME>     Select tracing session <NAME> (default: \"default\")\n");
+    printf("    -o <FILE>     Write to <FILE> at the interval (via <FILE>.tmp, e.g. for textfile collector)\n");
+    printf("    -d <SEC>      Update interval of <FILE> (default: %.1f)\n", DEFAULT_EXPORT_SEC);
+    printf("    -p [<ADDR>:]<PORT> Serve on HTTP <PORT> of <ADDR> (default: 127.0.0.1), counters are read per scrape\n");
+    printf("    -n <COUNT>    Exit after <COUNT> updates or scrapes (default: until interrupted)\n\n");
 #ifdef DEBUG
     printf("  SAMPLE COMMAND:\n");
     printf("    -s            Call sample function (klfer_sample_func)\n");
     printf("    ex) $ %s -s\n\n", APP);
+    printf("  SELF-TEST COMMAND:\n");
+    printf("    -X <LOOPS>    Self-test of logging path: call test function <LOOPS> times on every CPU\n");
+    printf("                  while toggling parameters, and check logs in a private session\n");
+    printf("    ex) $ %s -X 1000\n\n", APP);
 #endif
     printf("  (*1) <FUNC>       : Function name to be logged. MUST be symbol in kernel\n");
+    printf("     # <MODULE>:<FUNC> which is not loaded yet is registered when the module is loaded.\n");
+    printf("     # <PATH>:<SYMBOL|OFFSET> is a function in user space binary (uprobe),\n");
+    printf("     # logged as <SYMBOL|OFFSET>@<binary> (OFFSET: file offset, e.g. /usr/bin/foo:0x1140).\n");
     printf("  (*2) <FMT> {0..2} : Timestamp output format\n");
     printf("     # -T0 > Absolute time (default)\n");
     printf("     # -T1 > Relative time from the first log\n");
@@ -48,20 +101,234 @@ static void usage(void)
     printf("  (*3) JIT(Just-In-Time) print log\n");
     printf("     # Print a log each time.\n");
     printf("     # So, timestamp contains printk processing time.\n");
-    printf("     # Just-In-Time print log should not be used \n");
+    printf("     # Just-In-Time print log should not be used\n");
     printf("     #   if you want to measure function processing time.\n");
+    printf("  (*4) Session\n");
+    printf("     # Each session has its own registered functions, logs and settings.\n");
+    printf("     # A session is created when it is selected for the first time,\n");
+    printf("     #   and deleted by -R.\n");
+    printf("  (*5) Compact log format\n");
+    printf("     # Variable length records with delta timestamps.\n");
+    printf("     # Buffers hold several times more logs.\n");
+    printf("     # Logs are deleted when the format is changed.\n");
+    printf("  (*6) <SIZE> : Bytes with optional suffix K, M or G (ex. -B 256M)\n");
+    printf("  (*7) Paired-call record\n");
+    printf("     # One record 'p' with return time, duration, pid and cpu per call\n");
+    printf("     #   instead of 'e' and 'r' (entry time = return time - duration).\n");
+    printf("     # Calls shorter than the threshold of the function (-u) are not logged.\n");
+    printf("  (*8) Counters are updated while the logger is enabled, and cleared by -R.\n");
+    printf("     # Max is the longest duration since the function was registered.\n");
+    printf("  (*9) Stack capture\n");
+    printf("     # Stack of the caller is printed below 'r' / 'p' log of a sampled call\n");
+    printf("     #   which is not shorter than the threshold of the function (-u).\n");
+    printf("     # Unique stacks are saved once (max: module parameter STACKS).\n");
+    printf("     # -O resolves symbols by /proc/kallsyms (run as root).\n");
+    printf("  (*10) Follow mode\n");
+    printf("     # Logs of all CPUs are printed in time order.\n");
+    printf("     # A log is printed <MSEC> after its timestamp,\n");
+    printf("     #   since other CPUs may still be writing older logs.\n");
+    printf("  (*11) Arm / Disarm\n");
+    printf("     # A disarmed function is not logged but stays registered (Reg 'D' of -S),\n");
+    printf("     #   so it is armed again without registration. Names are the ones of -S.\n");
+    printf("     # -a and -x given together are applied at once.\n");
+    printf("  (*12) Probe overhead\n");
+    printf("     # Cost of the handlers included in a duration, measured in the current mode\n");
+    printf("     #   of the session on each CPU (<LOOPS>: 1..10000).\n");
+    printf("     # With -V, it is subtracted from durations of 'p' logs, thresholds (-u) and top.\n");
+    printf("  (*13) Quota\n");
+    printf("     # A function with quota is logged only in its share, and the shares not used yet\n");
+    printf("     #   are kept from the other functions. Total quota of a session is up to 100.\n");
+    printf("     # Dropped logs of each function are shown by -S.\n");
+}
+
+/**
+ * Parse user function "<PATH>:<SYMBOL|OFFSET>"
+ * func_name is set to "<SYMBOL|OFFSET>@<binary>", which is the name in logs.
+ * @param[in] *arg      Argument
+ * @param[out] *cfg     Configurations for registration (func_name, path, offset)
+ * @param[in] b_resolve 1: Resolve symbol to file offset (registration)
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int parse_user_func(const char *arg, struct klfer_func_cfg *cfg, int b_resolve)
+{
+    char bin[PATH_MAX], path[PATH_MAX];
+    const char *sep = strrchr(arg, ':'), *target, *base;
+    unsigned long long offset = 0;
+    char *end;
+
+    if(!sep || sep == arg || sep[1] == '\0' || sep - arg >= PATH_MAX)
+    {
+        fprintf(stderr, "User function must be <PATH>:<SYMBOL|OFFSET>: %s\n", arg);
+        return -1;
+    }
+    target = sep + 1;
+    memcpy(bin, arg, sep - arg);
+    bin[sep - arg] = '\0';
+    if(!realpath(bin, path) || strlen(path) >= MAX_PATH_LEN)
+    {
+        fprintf(stderr, "Invalid binary: %s\n", bin);
+        return -1;
+    }
+    base = strrchr(path, '/') + 1;
+    if(snprintf(cfg->func_name, MAX_STR_LEN, "%s@%s", target, base) >= MAX_STR_LEN)
+    {
+        fprintf(stderr, "Too long function name: %s@%s\n", target, base);
+        return -1;
+    }
+    if(isdigit((unsigned char)target[0]))
+    {
+        offset = strtoull(target, &end, 0);
+        if(*end != '\0') return -1;
+    }
+    else if(b_resolve && klfer_elf_offset(path, target, &offset))
+    {
+        return -1;
+    }
+    strcpy(cfg->path, path);
+    cfg->offset = offset;
+    return 0;
+}
+
+/**
+ * Parse size with optional suffix (K, M, G)
+ * @param[in] *str   String
+ * @param[out] *size Bytes
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int parse_size(const char *str, __u64 *size)
+{
+    char *end;
+
+    *size = strtoull(str, &end, 0);
+    switch(*end)
+    {
+    case 'G': case 'g':
+        *size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        *size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        *size <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return (end == str || *end != '\0' || *size == 0) ? -1 : 0;
+}
+
+#ifdef DEBUG
+/**
+ * Print results of self-test
+ * @param[in] *cfg Results
+ * @retval  0 Passed
+ * @retval -1 Failed
+ */
+static int print_selftest(const struct klfer_selftest_cfg *cfg)
+{
+    int b_fail = (cfg->broken || cfg->unpaired || cfg->miscounts);
+
+    printf("CPUs          : %u (%u calls each)\n", cfg->num_threads, cfg->loops);
+    printf("Steady phase  : %llu logged + %llu dropped / %llu expected\n",
+           (unsigned long long)cfg->records, (unsigned long long)cfg->dropped,
+           (unsigned long long)cfg->expected);
+    printf("Churn phase   : %llu logged, %u control operations\n",
+           (unsigned long long)cfg->churn_records, cfg->toggles);
+    printf("Broken logs   : %u\n", cfg->broken);
+    printf("Unpaired logs : %u\n", cfg->unpaired);
+    printf("Miscounts     : %u\n", cfg->miscounts);
+    printf("%s\n", b_fail ? "FAILED (see dmesg)" : "PASSED");
+    return b_fail ? -1 : 0;
+}
+#endif
+
+/**
+ * Print results of calibration
+ * @param[in] *cfg Results
+ */
+static void print_calib(const struct klfer_calib_cfg *cfg)
+{
+    printf("CPUs          : %u (%u calls each)\n", cfg->num_cpus, cfg->loops);
+    printf("Overhead      : %llu nsec (min %llu / max %llu)\n",
+           (unsigned long long)cfg->avg_ns, (unsigned long long)cfg->min_ns,
+           (unsigned long long)cfg->max_ns);
+}
+
+/**
+ * Convert comma separated function names to mask of function indexes
+ * @param[in] *info   Session information (registered functions)
+ * @param[in] *names  Function names (NULL: none)
+ * @param[out] *mask  Function indexes (bit)
+ * @retval  0 Success
+ * @retval -1 Error (a function is not registered)
+ */
+static int names_to_mask(const struct klfer_info *info, char *names, __u32 *mask)
+{
+    char *name, *save;
+    unsigned int func_idx;
+
+    *mask = 0;
+    if(!names) return 0;
+    for(name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save))
+    {
+        for(func_idx=0; func_idx<info->num_of_funcs; func_idx++)
+        {
+            if(strcmp(info->func_names[func_idx], name) == 0) break;
+        }
+        if(func_idx == info->num_of_funcs)
+        {
+            fprintf(stderr, "%s is not registered.\n", name);
+            return -1;
+        }
+        *mask |= 1U << func_idx;
+    }
+    return 0;
+}
+
+/**
+ * Arm / disarm functions by one ioctl
+ * @param[in] fd      Device file
+ * @param[in] *lists  Function names to be armed / disarmed
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int arm_funcs(int fd, struct arm_lists *lists)
+{
+    struct klfer_info info;
+    struct klfer_arm_cfg arm_cfg;
+
+    if(ioctl(fd, KLFER_GET_INFO, &info) < 0)
+    {
+        perror("ioctl (info)");
+        return -1;
+    }
+    if(names_to_mask(&info, lists->arm, &arm_cfg.arm_mask) ||
+       names_to_mask(&info, lists->disarm, &arm_cfg.disarm_mask))
+    {
+        return -1;
+    }
+    if(ioctl(fd, KLFER_ARM_FUNCS, &arm_cfg) < 0)
+    {
+        perror("ioctl");
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Command by ioctl
- * @param[in] cmd      Command ID
- * @param[in] *param   Command configurations
+ * @param[in] cmd       Command ID (ioctl number does not fit in int, e.g. _IOWR)
+ * @param[in] *param    Command configurations
+ * @param[in] *sess_cfg Session to be selected (NULL: default session)
  * @retval  0 Success
  * @retval -1 Error
  */
-int klfer_command(int cmd, void *param)
+int klfer_command(unsigned long cmd, void *param, struct klfer_session_cfg *sess_cfg)
 {
-    int fd;
+    int fd, ret;
 
     fd = open(DEVICE_FILE_PATH, O_RDWR);
     if(fd < 0)
@@ -69,14 +336,175 @@ int klfer_command(int cmd, void *param)
         perror("open");
         return -1;
     }
-    if(ioctl(fd, cmd, param) < 0)
+    if(sess_cfg && ioctl(fd, KLFER_SET_SESSION, sess_cfg) < 0)
+    {
+        perror("ioctl (session)");
+        close(fd);
+        return -1;
+    }
+    if(cmd == KLFER_OUTPUT_LOGS || cmd == KLFER_TOP || cmd == KLFER_ARM || cmd == KLFER_EXPORT)
+    {
+        switch(cmd)
+        {
+        case KLFER_TOP: ret = klfer_top(fd, param);         break;
+        case KLFER_EXPORT: ret = klfer_export(fd, param);   break;
+        case KLFER_ARM: ret = arm_funcs(fd, param);         break;
+        default:        ret = klfer_output_logs(fd, param); break;
+        }
+        close(fd);
+        return ret;
+    }
+    ret = ioctl(fd, cmd, param);
+    if(ret < 0)
     {
         perror("ioctl");
         close(fd);
         return -1;
     }
+    if(cmd == KLFER_REG_FUNC && ret == KLFER_REG_PENDING)
+    {
+        printf("%s is pending until its module is loaded.\n", ((struct klfer_func_cfg *)param)->func_name);
+    }
+    if(cmd == KLFER_CALIBRATE)
+    {
+        print_calib(param);
+    }
+#ifdef DEBUG
+    if(cmd == KLFER_SELFTEST)
+    {
+        ret = print_selftest(param);
+    }
+#endif
     close(fd);
-    return 0;
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * top subcommand
+ * @param[in] argc    Number of arguments (argv[0] is "top")
+ * @param[in] *argv[] Arguments
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int top_command(int argc, char *argv[])
+{
+    int opt;
+    char *end;
+    struct klfer_top_cfg top_cfg =
+    {
+        .interval = 1.0,
+        .count = 0
+    };
+    struct klfer_session_cfg sess_cfg;
+    struct klfer_session_cfg *psess = NULL;
+
+    opterr = 0; // disable error message of getopt()
+    while((opt = getopt(argc, argv, "N:d:n:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'N':
+            if(strlen(optarg) >= MAX_STR_LEN) goto ERR_ARG;
+            strcpy(sess_cfg.name, optarg);
+            psess = &sess_cfg;
+            break;
+        case 'd':
+            top_cfg.interval = strtod(optarg, &end);
+            if(end == optarg || *end != '\0' || top_cfg.interval < 0.1) goto ERR_ARG;
+            break;
+        case 'n':
+            top_cfg.count = strtol(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || top_cfg.count <= 0) goto ERR_ARG;
+            break;
+        default:
+            goto ERR_ARG;
+        }
+    }
+    if(optind != argc) goto ERR_ARG;
+
+    return klfer_command(KLFER_TOP, &top_cfg, psess);
+ERR_ARG:
+    usage();
+    return -1;
+}
+
+/**
+ * export subcommand
+ * @param[in] argc    Number of arguments (argv[0] is "export")
+ * @param[in] *argv[] Arguments
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int export_command(int argc, char *argv[])
+{
+    int opt;
+    char *end, *colon;
+    char addr[INET_ADDRSTRLEN] = "127.0.0.1";
+    long port;
+    bool b_interval = false;
+    struct klfer_export_cfg export_cfg =
+    {
+        .session = DEFAULT_SESSION_NAME,
+        .path = NULL,
+        .addr = addr,
+        .port = 0,
+        .interval = DEFAULT_EXPORT_SEC,
+        .count = 0
+    };
+    struct klfer_session_cfg sess_cfg;
+    struct klfer_session_cfg *psess = NULL;
+
+    opterr = 0; // disable error message of getopt()
+    while((opt = getopt(argc, argv, "N:o:d:p:n:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'N':
+            if(strlen(optarg) >= MAX_STR_LEN) goto ERR_ARG;
+            strcpy(sess_cfg.name, optarg);
+            psess = &sess_cfg;
+            export_cfg.session = sess_cfg.name;
+            break;
+        case 'o':
+            if(export_cfg.port) goto ERR_ARG;
+            export_cfg.path = optarg;
+            break;
+        case 'd':
+            export_cfg.interval = strtod(optarg, &end);
+            if(end == optarg || *end != '\0' || export_cfg.interval < 0.1) goto ERR_ARG;
+            b_interval = true;
+            break;
+        case 'p':
+            if(export_cfg.path) goto ERR_ARG;
+            colon = strrchr(optarg, ':');
+            if(colon)
+            {
+                if(colon - optarg >= INET_ADDRSTRLEN) goto ERR_ARG;
+                memcpy(addr, optarg, colon - optarg);
+                addr[colon - optarg] = '\0';
+                optarg = colon + 1;
+            }
+            port = strtol(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || port <= 0 || port > 65535) goto ERR_ARG;
+            export_cfg.port = port;
+            break;
+        case 'n':
+            export_cfg.count = strtol(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || export_cfg.count <= 0) goto ERR_ARG;
+            break;
+        default:
+            goto ERR_ARG;
+        }
+    }
+    if(optind != argc) goto ERR_ARG;
+    if(!export_cfg.path && !export_cfg.port) goto ERR_ARG;
+    /* interval is for the file (port is read per scrape) */
+    if(b_interval && !export_cfg.path) goto ERR_ARG;
+
+    return klfer_command(KLFER_EXPORT, &export_cfg, psess);
+ERR_ARG:
+    usage();
+    return -1;
 }
 
 /**
@@ -89,38 +517,91 @@ int klfer_command(int cmd, void *param)
 int main(int argc, char *argv[])
 {
     int opt;
-    int cmd = KLFER_NO_COMMAND;
+    unsigned long cmd = KLFER_NO_COMMAND;
 #ifdef DEBUG
-    char *options = "A:D:REdJjT:tSLhs";
+    char *options = "N:A:u:q:D:REdJjT:tCcPpVvM:K:ka:x:B:SLOFW:hsX:";
 #else
-    char *options = "A:D:REdJjT:tSLh";
+    char *options = "N:A:u:q:D:REdJjT:tCcPpVvM:K:ka:x:B:SLOFW:h";
 #endif
     struct klfer_func_cfg func_cfg =
     {
         .func_name = "",
-        .b_reg = false
+        .b_reg = false,
+        .threshold_ns = 0,
+        .quota_pct = 0
     };
+    struct klfer_output_cfg out_cfg =
+    {
+        .b_follow = 0,
+        .window_ms = DEFAULT_WINDOW_MS
+    };
+#ifdef DEBUG
+    struct klfer_selftest_cfg selftest_cfg;
+#endif
+    struct klfer_calib_cfg calib_cfg;
+    struct arm_lists arm_lists =
+    {
+        .arm = NULL,
+        .disarm = NULL
+    };
+    struct klfer_session_cfg sess_cfg;
+    struct klfer_session_cfg *psess = NULL;
     int ctrl_param = 0;
+    __u64 buf_size;
+    __u32 stack_rate;
+    char *end;
+    bool b_threshold = false, b_quota = false, b_window = false;
     void *param = NULL;
 
     if(argc < 2) goto ERR_ARG;
+    if(ARG_REQ("top")) return top_command(argc - 1, argv + 1);
+    if(ARG_REQ("export")) return export_command(argc - 1, argv + 1);
 
     opterr = 0; // disable error message of getopt()
     while((opt = getopt(argc, argv, options)) != -1)
     {
         switch(opt)
         {
+        case 'N':
+            if(strlen(optarg) >= MAX_STR_LEN) goto ERR_ARG;
+            strcpy(sess_cfg.name, optarg);
+            psess = &sess_cfg;
+            break;
         case 'A':
             if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
             cmd = KLFER_REG_FUNC;
-            strcpy(func_cfg.func_name, optarg);
+            if(strchr(optarg, '/'))
+            {
+                if(parse_user_func(optarg, &func_cfg, 1)) return -1;
+            }
+            else
+            {
+                strcpy(func_cfg.func_name, optarg);
+            }
             func_cfg.b_reg = true;
             param = &func_cfg;
             break;
+        case 'u':
+            func_cfg.threshold_ns = strtoull(optarg, &end, 0);
+            if(end == optarg || *end != '\0') goto ERR_ARG;
+            b_threshold = true;
+            break;
+        case 'q':
+            func_cfg.quota_pct = strtoul(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || func_cfg.quota_pct > 100) goto ERR_ARG;
+            b_quota = true;
+            break;
         case 'D':
             if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
             cmd = KLFER_REG_FUNC;
-            strcpy(func_cfg.func_name, optarg);
+            if(strchr(optarg, '/'))
+            {
+                if(parse_user_func(optarg, &func_cfg, 0)) return -1;
+            }
+            else
+            {
+                strcpy(func_cfg.func_name, optarg);
+            }
             func_cfg.b_reg = false;
             param = &func_cfg;
             break;
@@ -178,6 +659,78 @@ int main(int argc, char *argv[])
             param = &ctrl_param;
             DISABLE_TS(ctrl_param);
             break;
+        case 'C':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_SET_PARAMS) goto ERR_ARG;
+            cmd = KLFER_SET_PARAMS;
+            param = &ctrl_param;
+            ENABLE_COMPACT(ctrl_param);
+            break;
+        case 'c':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_SET_PARAMS) goto ERR_ARG;
+            cmd = KLFER_SET_PARAMS;
+            param = &ctrl_param;
+            DISABLE_COMPACT(ctrl_param);
+            break;
+        case 'P':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_SET_PARAMS) goto ERR_ARG;
+            cmd = KLFER_SET_PARAMS;
+            param = &ctrl_param;
+            ENABLE_PAIRED(ctrl_param);
+            break;
+        case 'p':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_SET_PARAMS) goto ERR_ARG;
+            cmd = KLFER_SET_PARAMS;
+            param = &ctrl_param;
+            DISABLE_PAIRED(ctrl_param);
+            break;
+        case 'V':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_SET_PARAMS) goto ERR_ARG;
+            cmd = KLFER_SET_PARAMS;
+            param = &ctrl_param;
+            ENABLE_SUBTRACT(ctrl_param);
+            break;
+        case 'v':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_SET_PARAMS) goto ERR_ARG;
+            cmd = KLFER_SET_PARAMS;
+            param = &ctrl_param;
+            DISABLE_SUBTRACT(ctrl_param);
+            break;
+        case 'M':
+            if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
+            calib_cfg.loops = strtoul(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || calib_cfg.loops == 0) goto ERR_ARG;
+            cmd = KLFER_CALIBRATE;
+            param = &calib_cfg;
+            break;
+        case 'K':
+            if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
+            stack_rate = strtoul(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || stack_rate == 0) goto ERR_ARG;
+            cmd = KLFER_SET_STACK;
+            param = &stack_rate;
+            break;
+        case 'k':
+            if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
+            stack_rate = 0;
+            cmd = KLFER_SET_STACK;
+            param = &stack_rate;
+            break;
+        case 'a':
+        case 'x':
+            if(cmd != KLFER_NO_COMMAND && cmd != KLFER_ARM) goto ERR_ARG;
+            cmd = KLFER_ARM;
+            if(opt == 'a')
+                arm_lists.arm = optarg;
+            else
+                arm_lists.disarm = optarg;
+            param = &arm_lists;
+            break;
+        case 'B':
+            if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
+            if(parse_size(optarg, &buf_size)) goto ERR_ARG;
+            cmd = KLFER_RESIZE_BUF;
+            param = &buf_size;
+            break;
         case 'S':
             if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
             cmd = KLFER_DUMP_SETTINGS;
@@ -186,6 +739,19 @@ int main(int argc, char *argv[])
             if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
             cmd = KLFER_DUMP_LOGS;
             break;
+        case 'O':
+            if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
+            cmd = KLFER_OUTPUT_LOGS;
+            param = &out_cfg;
+            break;
+        case 'F':
+            out_cfg.b_follow = 1;
+            break;
+        case 'W':
+            out_cfg.window_ms = strtoul(optarg, &end, 0);
+            if(end == optarg || *end != '\0') goto ERR_ARG;
+            b_window = true;
+            break;
         case 'h':
             usage();
             return 0;
@@ -194,14 +760,26 @@ int main(int argc, char *argv[])
             if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
             cmd = KLFER_SAMPLE;
             break;
+        case 'X':
+            if(cmd != KLFER_NO_COMMAND) goto ERR_ARG;
+            selftest_cfg.loops = strtoul(optarg, &end, 0);
+            if(end == optarg || *end != '\0' || selftest_cfg.loops == 0) goto ERR_ARG;
+            cmd = KLFER_SELFTEST;
+            param = &selftest_cfg;
+            break;
 #endif
         default:
             goto ERR_ARG;
         }
     }
     if(cmd == KLFER_NO_COMMAND) goto ERR_ARG;
+    /* threshold and quota are given with registration */
+    if((b_threshold || b_quota) && !(cmd == KLFER_REG_FUNC && func_cfg.b_reg)) goto ERR_ARG;
+    /* follow mode is an option of output */
+    if(out_cfg.b_follow && cmd != KLFER_OUTPUT_LOGS) goto ERR_ARG;
+    if(b_window && !out_cfg.b_follow) goto ERR_ARG;
 
-    return klfer_command(cmd, param);
+    return klfer_command(cmd, param, psess);
 ERR_ARG:
     usage();
     return -1;
@@ -0,0 +1,146 @@
+/**
+ * @file  klfer_elf.c
+ * @brief ELF symbol resolver of KLFER application (user functions)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "klfer_elf.h"
+
+/* [off, off + len) is in the file */
+#define IN_FILE(off, len, size) ((off) <= (size) && (len) <= (size) - (off))
+
+/**
+ * Search function symbol in a symbol table section
+ * @param[in] *map  Mapped file
+ * @param[in] size  File size
+ * @param[in] *sh   Symbol table section
+ * @param[in] *shs  Section headers
+ * @param[in] shnum Number of sections
+ * @param[in] *sym  Symbol name
+ * @return Virtual address of the symbol (0: not found)
+ */
+static Elf64_Addr klfer_elf_lookup(const unsigned char *map, size_t size, const Elf64_Shdr *sh,
+                                   const Elf64_Shdr *shs, unsigned int shnum, const char *sym)
+{
+    const Elf64_Sym *syms;
+    const Elf64_Shdr *strsh;
+    const char *name;
+    size_t i, num, len = strlen(sym);
+
+    if(sh->sh_link >= shnum || !IN_FILE(sh->sh_offset, sh->sh_size, size)) return 0;
+    strsh = &shs[sh->sh_link];
+    if(!IN_FILE(strsh->sh_offset, strsh->sh_size, size)) return 0;
+    syms = (const Elf64_Sym *)(map + sh->sh_offset);
+    num = sh->sh_size / sizeof(*syms);
+    for(i=0; i<num; i++)
+    {
+        if(ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC &&
+           ELF64_ST_TYPE(syms[i].st_info) != STT_GNU_IFUNC) continue;
+        if(syms[i].st_shndx == SHN_UNDEF || syms[i].st_value == 0) continue;
+        if(syms[i].st_name >= strsh->sh_size || strsh->sh_size - syms[i].st_name <= len) continue;
+        name = (const char *)(map + strsh->sh_offset + syms[i].st_name);
+        /* "sym" or versioned "sym@VERSION" in .symtab */
+        if(strncmp(name, sym, len) == 0 && (name[len] == '\0' || name[len] == '@'))
+        {
+            return syms[i].st_value;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get file offset of function symbol (for uprobe)
+ * .symtab is searched first, then .dynsym (stripped binaries). Only 64-bit ELF is supported.
+ * @param[in] *path   Binary
+ * @param[in] *sym    Function name
+ * @param[out] *offset File offset of the function
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+int klfer_elf_offset(const char *path, const char *sym, unsigned long long *offset)
+{
+    const unsigned char *map;
+    const Elf64_Ehdr *eh;
+    const Elf64_Shdr *shs;
+    const Elf64_Phdr *phs;
+    Elf64_Addr addr = 0;
+    struct stat st;
+    size_t size;
+    unsigned int i, pass;
+    int fd, ret = -1;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*eh))
+    {
+        fprintf(stderr, "%s: not an ELF file\n", path);
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    eh = (const Elf64_Ehdr *)map;
+    if(memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64)
+    {
+        fprintf(stderr, "%s: not a 64-bit ELF file\n", path);
+        goto EXIT;
+    }
+    if(!IN_FILE(eh->e_shoff, (size_t)eh->e_shnum * sizeof(*shs), size) ||
+       !IN_FILE(eh->e_phoff, (size_t)eh->e_phnum * sizeof(*phs), size))
+    {
+        fprintf(stderr, "%s: broken ELF headers\n", path);
+        goto EXIT;
+    }
+    shs = (const Elf64_Shdr *)(map + eh->e_shoff);
+    phs = (const Elf64_Phdr *)(map + eh->e_phoff);
+
+    for(pass=0; pass<2 && addr==0; pass++)
+    {
+        for(i=0; i<eh->e_shnum && addr==0; i++)
+        {
+            if(shs[i].sh_type != (pass == 0 ? SHT_SYMTAB : SHT_DYNSYM)) continue;
+            addr = klfer_elf_lookup(map, size, &shs[i], shs, eh->e_shnum, sym);
+        }
+    }
+    if(addr == 0)
+    {
+        fprintf(stderr, "%s: function %s is not found\n", path, sym);
+        goto EXIT;
+    }
+    /* virtual address -> file offset */
+    for(i=0; i<eh->e_phnum; i++)
+    {
+        if(phs[i].p_type != PT_LOAD) continue;
+        if(addr >= phs[i].p_vaddr && addr < phs[i].p_vaddr + phs[i].p_filesz)
+        {
+            *offset = addr - phs[i].p_vaddr + phs[i].p_offset;
+            ret = 0;
+            break;
+        }
+    }
+    if(ret)
+    {
+        fprintf(stderr, "%s: function %s is not in loadable segments\n", path, sym);
+    }
+EXIT:
+    munmap((void *)map, size);
+    return ret;
+}
@@ -0,0 +1,10 @@
+/**
+ * @file  klfer_elf.h
+ * @brief ELF symbol resolver of KLFER application (user functions)
+ */
+#ifndef _KLFER_ELF_H_
+#define _KLFER_ELF_H_
+
+int klfer_elf_offset(const char *path, const char *sym, unsigned long long *offset);
+
+#endif /* _KLFER_ELF_H_ */
@@ -0,0 +1,365 @@
+/**
+ * @file  klfer_export.c
+ * @brief Exporter of per-function counters of KLFER application (Prometheus text format)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "klfer_api.h"
+#include "klfer_export.h"
+
+#define EXPORT_REQ_SIZE  1024
+#define EXPORT_BACKLOG   8
+#define EXPORT_RECV_SEC  1   // Timeout of reading a request
+
+/**
+ * Sleep for the interval
+ * @param[in] interval Seconds
+ */
+static void klfer_export_sleep(double interval)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/**
+ * Read counters of the session
+ * Names and state come with the counters, so they always match
+ * even if functions are reset and registered in the meantime.
+ * @param[in] fd      Device file
+ * @param[out] *stats Snapshot
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int klfer_export_snapshot(int fd, struct klfer_stats *stats)
+{
+    if(ioctl(fd, KLFER_GET_STATS, stats) < 0)
+    {
+        perror("ioctl (stats)");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Print a label value with escapes of the text format
+ * @param[in] *fp  Output
+ * @param[in] *str Label value
+ */
+static void klfer_export_label(FILE *fp, const char *str)
+{
+    for(; *str != '\0'; str++)
+    {
+        switch(*str)
+        {
+        case '\\': fputs("\\\\", fp); break;
+        case '"':  fputs("\\\"", fp); break;
+        case '\n': fputs("\\n", fp);  break;
+        default:   fputc(*str, fp);   break;
+        }
+    }
+}
+
+/**
+ * Print HELP and TYPE lines of a metric
+ * @param[in] *fp   Output
+ * @param[in] *name Metric name
+ * @param[in] *type counter / gauge / histogram
+ * @param[in] *help Description
+ */
+static void klfer_export_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n", name, help);
+    fprintf(fp, "# TYPE %s %s\n", name, type);
+}
+
+/**
+ * Print name and labels of a sample (value follows)
+ * @param[in] *fp      Output
+ * @param[in] *name    Metric name
+ * @param[in] *session Session name
+ * @param[in] *func    Function name (NULL: metric of session)
+ * @param[in] *le      Upper bound of histogram bucket (NULL: not a bucket)
+ */
+static void klfer_export_name(FILE *fp, const char *name, const char *session, const char *func, const char *le)
+{
+    fprintf(fp, "%s{session=\"", name);
+    klfer_export_label(fp, session);
+    if(func)
+    {
+        fputs("\",function=\"", fp);
+        klfer_export_label(fp, func);
+    }
+    if(le)
+    {
+        fprintf(fp, "\",le=\"%s", le);
+    }
+    fputs("\"} ", fp);
+}
+
+/**
+ * Print histogram of a function
+ * Buckets are cumulative, and _count is the sum of buckets rather than calls,
+ * since counters of CPUs are read while the handlers update them.
+ * @param[in] *fp      Output
+ * @param[in] *session Session name
+ * @param[in] *func    Function name
+ * @param[in] *stat    Counters of the function
+ */
+static void klfer_export_hist(FILE *fp, const char *session, const char *func, const struct klfer_func_stat *stat)
+{
+    unsigned long long count = 0, le_ns;
+    char le[32];
+    int i;
+
+    for(i=0; i<KLFER_HIST_BUCKETS; i++)
+    {
+        count += stat->hist[i];
+        if(i < KLFER_HIST_BUCKETS - 1)
+        {
+            le_ns = 1ULL << i;
+            snprintf(le, sizeof(le), "%llu.%09llu", le_ns / 1000000000ULL, le_ns % 1000000000ULL);
+        }
+        else
+        {
+            strcpy(le, "+Inf");
+        }
+        klfer_export_name(fp, "klfer_duration_seconds_bucket", session, func, le);
+        fprintf(fp, "%llu\n", count);
+    }
+    klfer_export_name(fp, "klfer_duration_seconds_sum", session, func, NULL);
+    fprintf(fp, "%llu.%09llu\n", (unsigned long long)(stat->total_ns / 1000000000ULL),
+            (unsigned long long)(stat->total_ns % 1000000000ULL));
+    klfer_export_name(fp, "klfer_duration_seconds_count", session, func, NULL);
+    fprintf(fp, "%llu\n", count);
+}
+
+/**
+ * Print metrics of the snapshot
+ * Durations are printed in seconds without rounding (nsec precision).
+ * @param[in] *fp      Output
+ * @param[in] *session Session name
+ * @param[in] *stats   Snapshot
+ */
+static void klfer_export_print(FILE *fp, const char *session, const struct klfer_stats *stats)
+{
+    const struct klfer_func_stat *stat = stats->funcs;
+    int i, num = stats->num_of_funcs;
+
+    klfer_export_header(fp, "klfer_logger_enabled", "gauge", "Whether the logger of the session is enabled.");
+    klfer_export_name(fp, "klfer_logger_enabled", session, NULL, NULL);
+    fprintf(fp, "%d\n", (stats->state & (VALUE_BIT << LOGGER_CTRL_SHIFT)) ? 1 : 0);
+
+    klfer_export_header(fp, "klfer_duration_seconds", "histogram",
+                        "Durations of the calls which returned while the logger is enabled.");
+    for(i=0; i<num; i++)
+    {
+        klfer_export_hist(fp, session, stats->func_names[i], &stat[i]);
+    }
+    klfer_export_header(fp, "klfer_duration_max_seconds", "gauge", "Longest duration since the function was registered.");
+    for(i=0; i<num; i++)
+    {
+        klfer_export_name(fp, "klfer_duration_max_seconds", session, stats->func_names[i], NULL);
+        fprintf(fp, "%llu.%09llu\n", (unsigned long long)(stat[i].max_ns / 1000000000ULL),
+                (unsigned long long)(stat[i].max_ns % 1000000000ULL));
+    }
+    klfer_export_header(fp, "klfer_dropped_logs_total", "counter", "Logs dropped for lack of space or quota, and returns whose entry is unknown.");
+    for(i=0; i<num; i++)
+    {
+        klfer_export_name(fp, "klfer_dropped_logs_total", session, stats->func_names[i], NULL);
+        fprintf(fp, "%llu\n", (unsigned long long)stat[i].dropped);
+    }
+}
+
+/**
+ * Update output file at the interval
+ * Metrics are written to <FILE>.tmp and renamed to <FILE>,
+ * so a reader never sees a partial file.
+ * @param[in] fd   Device file
+ * @param[in] *cfg Export configurations
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int klfer_export_file(int fd, const struct klfer_export_cfg *cfg)
+{
+    struct klfer_stats stats;
+    char *tmp;
+    FILE *fp;
+    int n, ret = -1;
+
+    memset(&stats, 0, sizeof(stats));
+    tmp = malloc(strlen(cfg->path) + sizeof(".tmp"));
+    if(!tmp)
+    {
+        perror("malloc");
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", cfg->path);
+    for(n=0; cfg->count == 0 || n<cfg->count; n++)
+    {
+        if(n) klfer_export_sleep(cfg->interval);
+        if(klfer_export_snapshot(fd, &stats)) goto EXIT;
+        fp = fopen(tmp, "w");
+        if(!fp)
+        {
+            perror(tmp);
+            goto EXIT;
+        }
+        klfer_export_print(fp, cfg->session, &stats);
+        if(fclose(fp) != 0)
+        {
+            perror(tmp);
+            goto EXIT;
+        }
+        if(rename(tmp, cfg->path) < 0)
+        {
+            perror("rename");
+            goto EXIT;
+        }
+    }
+    ret = 0;
+EXIT:
+    free(tmp);
+    return ret;
+}
+
+/**
+ * Read HTTP request header
+ * @param[in] sock Connected socket
+ * @retval  1 GET request
+ * @retval  0 Other request
+ * @retval -1 Error (closed or timed out)
+ */
+static int klfer_export_request(int sock)
+{
+    char req[EXPORT_REQ_SIZE];
+    size_t len = 0;
+    ssize_t ret;
+
+    while(len < sizeof(req) - 1)
+    {
+        ret = read(sock, req + len, sizeof(req) - 1 - len);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return -1;
+        len += ret;
+        req[len] = '\0';
+        if(strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+    }
+    return (len >= 4 && strncmp(req, "GET ", 4) == 0) ? 1 : 0;
+}
+
+/**
+ * Serve metrics on the port
+ * Counters are read for each scrape. A scrape which fails to read them gets
+ * 503, and the next scrape is served as usual.
+ * @param[in] fd   Device file
+ * @param[in] *cfg Export configurations
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int klfer_export_serve(int fd, const struct klfer_export_cfg *cfg)
+{
+    struct klfer_stats stats;
+    struct sockaddr_in addr;
+    struct timeval tv = { .tv_sec = EXPORT_RECV_SEC };
+    int lsock, sock, n = 0, on = 1, ret = -1;
+    FILE *fp;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg->port);
+    if(inet_pton(AF_INET, cfg->addr, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address: %s\n", cfg->addr);
+        return -1;
+    }
+    /* a scraper may close the connection before the response is written */
+    signal(SIGPIPE, SIG_IGN);
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if(lsock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lsock, EXPORT_BACKLOG) < 0)
+    {
+        perror("bind");
+        goto EXIT;
+    }
+    while(cfg->count == 0 || n < cfg->count)
+    {
+        sock = accept(lsock, NULL, NULL);
+        if(sock < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            goto EXIT;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        fp = fdopen(sock, "w");
+        if(!fp)
+        {
+            perror("fdopen");
+            close(sock);
+            continue;
+        }
+        switch(klfer_export_request(sock))
+        {
+        case 1:
+            if(klfer_export_snapshot(fd, &stats))
+            {
+                /* error may be transient (e.g. during reset), so keep serving */
+                fputs("HTTP/1.0 503 Service Unavailable\r\n\r\n", fp);
+                break;
+            }
+            fputs("HTTP/1.0 200 OK\r\n", fp);
+            fputs("Content-Type: text/plain; version=0.0.4\r\n", fp);
+            fputs("Connection: close\r\n\r\n", fp);
+            klfer_export_print(fp, cfg->session, &stats);
+            n++;
+            break;
+        case 0:
+            fputs("HTTP/1.0 405 Method Not Allowed\r\n\r\n", fp);
+            break;
+        default:
+            break;
+        }
+        fclose(fp);
+    }
+    ret = 0;
+EXIT:
+    close(lsock);
+    return ret;
+}
+
+/**
+ * Export histograms of durations, max durations and dropped logs of registered functions
+ * in Prometheus text format, to a file or on a port
+ * @param[in] fd   Device file
+ * @param[in] *cfg Export configurations
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+int klfer_export(int fd, const struct klfer_export_cfg *cfg)
+{
+    if(cfg->path)
+    {
+        return klfer_export_file(fd, cfg);
+    }
+    return klfer_export_serve(fd, cfg);
+}
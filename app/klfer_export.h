@@ -0,0 +1,19 @@
+/**
+ * @file  klfer_export.h
+ * @brief Exporter of per-function counters of KLFER application (Prometheus text format)
+ */
+#ifndef _KLFER_EXPORT_H_
+#define _KLFER_EXPORT_H_
+
+struct klfer_export_cfg {
+    const char *session;  // Session name (label of metrics)
+    const char *path;     // Output file (NULL: serve on port)
+    const char *addr;     // Listen address (IPv4 dotted decimal)
+    int    port;          // Listen port
+    double interval;      // Update interval of output file (sec)
+    int    count;         // Number of updates or scrapes (0: until interrupted)
+};
+
+int klfer_export(int fd, const struct klfer_export_cfg *cfg);
+
+#endif /* _KLFER_EXPORT_H_ */
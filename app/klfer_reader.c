@@ -0,0 +1,421 @@
+/**
+ * @file  klfer_reader.c
+ * @brief Log reader of KLFER application (decode and merge per-CPU log streams)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "klfer_api.h"
+#include "klfer_fmt.h"
+#include "klfer_reader.h"
+#include "klfer_sym.h"
+
+/* Bytes read from a log stream at once (whole blocks) */
+#define KLFER_READ_CHUNK (KLFER_BLOCK_SIZE * 64)
+
+/* Result of klfer_next_event() for the stream which cannot be read any more */
+#define KLFER_STREAM_GONE -2
+
+/* Log stream of one CPU */
+struct klfer_stream {
+    unsigned int cpu;
+    __u8 *data;              // Chunk of the stream
+    __u64 offset;            // Offset of the chunk in the stream
+    __u64 dropped;
+    struct klfer_cursor cur;
+    struct klfer_event ev;
+    int ret;                 // Result of klfer_next_event() for ev
+};
+
+/* Min-heap of streams ordered by timestamp of the next event */
+struct klfer_heap {
+    struct klfer_stream **node;
+    unsigned int num;
+};
+
+/* Set by SIGINT in follow mode */
+static volatile sig_atomic_t b_stop;
+
+/* Stacks fetched from the LKM (indexed by stack ID) */
+struct klfer_stack_cache {
+    struct klfer_stack_cfg *stacks;  // nr_entries is 0 until fetched
+    __u32 num;
+    int   b_sym;                     // Kernel symbols are loaded
+};
+
+/**
+ * Read a chunk of log stream
+ * Chunks begin at block (COMPACT) or record (FIXED) boundary,
+ * so that the cursor can continue decoding across chunks.
+ * @param[in] fd       Device file
+ * @param[in] *info    Session information
+ * @param[in,out] *st  Log stream
+ * @param[in] pos      Position in the stream to continue decoding from
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+static int klfer_read_chunk(int fd, const struct klfer_info *info, struct klfer_stream *st, __u64 pos)
+{
+    struct klfer_read_cfg cfg;
+    __u64 time = st->cur.time;
+
+    if(info->log_fmt == KLFER_FMT_COMPACT)
+        st->offset = pos / KLFER_BLOCK_SIZE * KLFER_BLOCK_SIZE;
+    else
+        st->offset = pos;
+    cfg.cpu = st->cpu;
+    cfg.offset = st->offset;
+    cfg.len = KLFER_READ_CHUNK;
+    cfg.buf = (__u64)(uintptr_t)st->data;
+    if(ioctl(fd, KLFER_READ_LOGS, &cfg) < 0)
+    {
+        return -1;
+    }
+    if(cfg.committed < pos)
+    {
+        fprintf(stderr, "Err: logs on cpu%u were deleted while reading\n", st->cpu);
+        return -1;
+    }
+    st->dropped = cfg.dropped;
+    klfer_cursor_init(&st->cur, st->data, cfg.len, 0, info->log_fmt, st->cpu);
+    st->cur.pos = pos - st->offset;
+    st->cur.time = time;
+    return 0;
+}
+
+/**
+ * Decode next event of log stream (read next chunk if needed)
+ * @param[in] fd       Device file
+ * @param[in] *info    Session information
+ * @param[in,out] *st  Log stream (st->ev and st->ret are updated)
+ */
+static void klfer_stream_next(int fd, const struct klfer_info *info, struct klfer_stream *st)
+{
+    st->ret = klfer_next_event(&st->cur, &st->ev);
+    if(st->ret != 0) return;
+    /* end of chunk (or end of committed logs) */
+    if(klfer_read_chunk(fd, info, st, st->offset + st->cur.pos) < 0)
+    {
+        st->ret = KLFER_STREAM_GONE;
+        return;
+    }
+    st->ret = klfer_next_event(&st->cur, &st->ev);
+}
+
+static int klfer_stream_less(const struct klfer_stream *a, const struct klfer_stream *b)
+{
+    if(a->ev.time != b->ev.time) return a->ev.time < b->ev.time;
+    return a->cpu < b->cpu;
+}
+
+/**
+ * Move down the node to keep heap order
+ * @param[in,out] *h Heap
+ * @param[in] i      Index of node
+ */
+static void klfer_heap_down(struct klfer_heap *h, unsigned int i)
+{
+    struct klfer_stream *st = h->node[i];
+    unsigned int child;
+
+    while((child = i * 2 + 1) < h->num)
+    {
+        if(child + 1 < h->num && klfer_stream_less(h->node[child + 1], h->node[child])) child++;
+        if(!klfer_stream_less(h->node[child], st)) break;
+        h->node[i] = h->node[child];
+        i = child;
+    }
+    h->node[i] = st;
+}
+
+/**
+ * Add stream to heap
+ * @param[in,out] *h Heap
+ * @param[in] *st    Stream which has an event
+ */
+static void klfer_heap_push(struct klfer_heap *h, struct klfer_stream *st)
+{
+    unsigned int i = h->num++, parent;
+
+    while(i > 0)
+    {
+        parent = (i - 1) / 2;
+        if(!klfer_stream_less(st, h->node[parent])) break;
+        h->node[i] = h->node[parent];
+        i = parent;
+    }
+    h->node[i] = st;
+}
+
+/**
+ * Remove the oldest stream from heap
+ * @param[in,out] *h Heap
+ */
+static void klfer_heap_pop(struct klfer_heap *h)
+{
+    if(--h->num == 0) return;
+    h->node[0] = h->node[h->num];
+    klfer_heap_down(h, 0);
+}
+
+/**
+ * Open log stream
+ * @param[in] fd       Device file
+ * @param[in] cpu      CPU
+ * @param[in] *info    Session information
+ * @param[out] *st     Log stream
+ * @retval  0 Success
+ * @retval -1 Error (the CPU has no stream)
+ */
+static int klfer_open_stream(int fd, unsigned int cpu, const struct klfer_info *info, struct klfer_stream *st)
+{
+    st->cpu = cpu;
+    st->ret = 0;
+    st->cur.time = 0;
+    st->data = malloc(KLFER_READ_CHUNK);
+    if(!st->data)
+    {
+        perror("malloc");
+        return -1;
+    }
+    if(klfer_read_chunk(fd, info, st, 0) < 0)
+    {
+        return -1;
+    }
+    st->ret = klfer_next_event(&st->cur, &st->ev);
+    return 0;
+}
+
+/**
+ * Print event log (same format as the LKM)
+ * @param[in] *info     Session information
+ * @param[in] seq       Sequence number (1 origin)
+ * @param[in] *ev       Event
+ * @param[in] timestamp Timestamp to be printed (nsec)
+ */
+static void klfer_print_event(const struct klfer_info *info, int seq, const struct klfer_event *ev, long long timestamp)
+{
+    if(info->state & (VALUE_BIT << TIMESTAMP_CTRL_SHIFT))
+    {
+        printf("[ %20lld nsec] ", timestamp);
+    }
+    printf("[%d] %c %s", seq, ev->event_id,
+           (ev->func_idx < info->num_of_funcs ? info->func_names[ev->func_idx] : "?"));
+    if(ev->event_id == 'p')
+    {
+        printf(" %llu nsec (pid %u, cpu %u)", (unsigned long long)ev->duration, ev->pid, ev->cpu);
+    }
+    printf("\n");
+}
+
+/**
+ * Print stack of event (fetched from the LKM only once per stack ID)
+ * @param[in] fd        Device file
+ * @param[in,out] *sc   Stack cache
+ * @param[in] stack_id  Stack ID (0: no stack)
+ */
+static void klfer_print_stack(int fd, struct klfer_stack_cache *sc, __u32 stack_id)
+{
+    struct klfer_stack_cfg *tmp;
+    char sym[256];
+    __u32 i, num;
+
+    if(stack_id == 0) return;
+    if(stack_id > KLFER_MAX_STACKS)
+    {
+        fprintf(stderr, "Err: invalid stack ID %u\n", stack_id);
+        return;
+    }
+    if(stack_id >= sc->num)
+    {
+        num = (stack_id < KLFER_MAX_STACKS / 2) ? (stack_id + 1) * 2 : KLFER_MAX_STACKS + 1;
+        tmp = realloc(sc->stacks, sizeof(*tmp) * num);
+        if(!tmp) return;
+        memset(tmp + sc->num, 0, sizeof(*tmp) * (num - sc->num));
+        sc->stacks = tmp;
+        sc->num = num;
+    }
+    if(sc->stacks[stack_id].nr_entries == 0)
+    {
+        sc->stacks[stack_id].stack_id = stack_id;
+        if(ioctl(fd, KLFER_GET_STACK, &sc->stacks[stack_id]) < 0) return;
+        if(!sc->b_sym)
+        {
+            klfer_sym_load();
+            sc->b_sym = 1;
+        }
+    }
+    for(i=0; i<sc->stacks[stack_id].nr_entries; i++)
+    {
+        klfer_sym_resolve(sc->stacks[stack_id].entries[i], sym, sizeof(sym));
+        printf("    %s\n", sym);
+    }
+}
+
+/**
+ * Current time of the clock used by the LKM for timestamps
+ * @return Monotonic clock (nsec)
+ */
+static __u64 klfer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sleep for milliseconds
+ * @param[in] msec Milliseconds
+ */
+static void klfer_sleep_ms(unsigned int msec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000L;
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR && !b_stop);
+}
+
+static void klfer_stop(int sig)
+{
+    b_stop = 1;
+}
+
+/**
+ * Output logs of all CPUs in time order to stdout
+ * Streams are merged by a heap of their next events. In follow mode, streams
+ * at their end are polled for new logs, and an event is held until it is older
+ * than the reorder window, because other CPUs may still commit older events.
+ * @param[in] fd   Device file
+ * @param[in] *cfg Output configurations
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+int klfer_output_logs(int fd, const struct klfer_output_cfg *cfg)
+{
+    struct klfer_info info;
+    struct klfer_stream *sts, *st;
+    struct klfer_heap heap = { NULL, 0 };
+    struct klfer_event *ev;
+    struct klfer_stack_cache sc = { NULL, 0, 0 };
+    unsigned int cpu;
+    int seq = 0, ret = 0;
+    __u64 first_time = 0, prev_time = 0, dropped = 0, time, window = 0, now = 0;
+    long long timestamp;
+
+    if(ioctl(fd, KLFER_GET_INFO, &info) < 0)
+    {
+        perror("ioctl (info)");
+        return -1;
+    }
+    sts = calloc(info.num_cpus, sizeof(*sts));
+    heap.node = calloc(info.num_cpus, sizeof(*heap.node));
+    if(!sts || !heap.node)
+    {
+        perror("calloc");
+        free(sts);
+        free(heap.node);
+        return -1;
+    }
+    for(cpu=0; cpu<info.num_cpus; cpu++)
+    {
+        /* CPU which is not possible has no stream */
+        if(klfer_open_stream(fd, cpu, &info, &sts[cpu]) < 0) sts[cpu].ret = KLFER_STREAM_GONE;
+        if(sts[cpu].ret > 0) klfer_heap_push(&heap, &sts[cpu]);
+        if(sts[cpu].ret == -1)
+        {
+            fprintf(stderr, "Err: broken log on cpu%u (offset 0)\n", cpu);
+            ret = -1;
+        }
+    }
+    if(cfg->b_follow)
+    {
+        signal(SIGINT, klfer_stop);
+        /* events cannot be ordered without timestamp */
+        if(info.state & (VALUE_BIT << TIMESTAMP_CTRL_SHIFT))
+        {
+            window = cfg->window_ms * 1000000ULL;
+        }
+    }
+
+    while(!b_stop)
+    {
+        if(heap.num > 0 && window && heap.node[0]->ev.time + window > now)
+        {
+            now = klfer_now();
+        }
+        if(heap.num == 0 || (window && heap.node[0]->ev.time + window > now))
+        {
+            if(!cfg->b_follow) break;
+            fflush(stdout);
+            klfer_sleep_ms(cfg->window_ms ? (cfg->window_ms + 1) / 2 : 10);
+            now = klfer_now();
+            /* streams at their end may have new logs */
+            for(cpu=0; cpu<info.num_cpus; cpu++)
+            {
+                if(sts[cpu].ret != 0) continue;
+                klfer_stream_next(fd, &info, &sts[cpu]);
+                if(sts[cpu].ret > 0) klfer_heap_push(&heap, &sts[cpu]);
+            }
+            continue;
+        }
+
+        st = heap.node[0];
+        ev = &st->ev;
+        /* return time is printed for paired-call record (same order as the merge) */
+        time = ev->time;
+        if(seq == 0) first_time = prev_time = time;
+        switch(TS_FMT_MASK(info.state))
+        {
+        case TS_FMT_RLTV_FIRST:
+            timestamp = time - first_time;
+            break;
+        case TS_FMT_RLTV_PREV:
+            timestamp = time - prev_time;
+            break;
+        default:
+            timestamp = time + info.time_offset;
+            break;
+        }
+        klfer_print_event(&info, ++seq, ev, timestamp);
+        klfer_print_stack(fd, &sc, ev->stack_id);
+        prev_time = time;
+
+        klfer_stream_next(fd, &info, st);
+        if(st->ret > 0)
+        {
+            klfer_heap_down(&heap, 0);
+            continue;
+        }
+        if(st->ret == -1)
+        {
+            fprintf(stderr, "Err: broken log on cpu%u (offset %llu)\n", st->cpu, st->offset + st->cur.pos);
+            ret = -1;
+        }
+        klfer_heap_pop(&heap);
+    }
+    fflush(stdout);
+
+    for(cpu=0; cpu<info.num_cpus; cpu++)
+    {
+        dropped += sts[cpu].dropped;
+        free(sts[cpu].data);
+    }
+    if(dropped)
+    {
+        fprintf(stderr, "Err: No log space - %llu logs dropped\n", dropped);
+    }
+    free(heap.node);
+    free(sts);
+    free(sc.stacks);
+    klfer_sym_unload();
+    return ret;
+}
@@ -0,0 +1,15 @@
+/**
+ * @file  klfer_reader.h
+ * @brief Log reader of KLFER application
+ */
+#ifndef _KLFER_READER_H_
+#define _KLFER_READER_H_
+
+struct klfer_output_cfg {
+    int          b_follow;   // Keep reading new logs until interrupted
+    unsigned int window_ms;  // Reorder window of follow mode (msec)
+};
+
+int klfer_output_logs(int fd, const struct klfer_output_cfg *cfg);
+
+#endif /* _KLFER_READER_H_ */
@@ -0,0 +1,133 @@
+/**
+ * @file  klfer_sym.c
+ * @brief Kernel symbol resolver of KLFER application (by /proc/kallsyms)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "klfer_sym.h"
+
+#define KALLSYMS_PATH "/proc/kallsyms"
+
+struct klfer_sym {
+    unsigned long long addr;
+    char *name;              // "symbol" or "symbol [module]"
+};
+
+static struct klfer_sym *syms;
+static size_t num_syms;
+
+static int klfer_sym_cmp(const void *a, const void *b)
+{
+    const struct klfer_sym *sa = a, *sb = b;
+
+    if(sa->addr == sb->addr) return 0;
+    return (sa->addr < sb->addr) ? -1 : 1;
+}
+
+/**
+ * Load kernel symbols
+ * Addresses are 0 unless the user is allowed to see them (kptr_restrict).
+ * @retval  0 Success
+ * @retval -1 Error (addresses are printed without symbols)
+ */
+int klfer_sym_load(void)
+{
+    FILE *fp;
+    char line[256], name[128], mod[128], type;
+    unsigned long long addr;
+    size_t cap = 0;
+    struct klfer_sym *tmp;
+    int n;
+
+    fp = fopen(KALLSYMS_PATH, "r");
+    if(!fp)
+    {
+        perror("fopen (" KALLSYMS_PATH ")");
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp))
+    {
+        n = sscanf(line, "%llx %c %127s %127s", &addr, &type, name, mod);
+        if(n < 3 || addr == 0) continue;
+        if(type != 't' && type != 'T' && type != 'w' && type != 'W') continue;
+        if(num_syms == cap)
+        {
+            cap = cap ? cap * 2 : 65536;
+            tmp = realloc(syms, sizeof(*syms) * cap);
+            if(!tmp) break;
+            syms = tmp;
+        }
+        syms[num_syms].addr = addr;
+        if(n == 4)
+        {
+            syms[num_syms].name = malloc(strlen(name) + strlen(mod) + 2);
+            if(syms[num_syms].name) sprintf(syms[num_syms].name, "%s %s", name, mod);
+        }
+        else
+        {
+            syms[num_syms].name = strdup(name);
+        }
+        if(!syms[num_syms].name) break;
+        num_syms++;
+    }
+    fclose(fp);
+    if(num_syms == 0)
+    {
+        fprintf(stderr, "Err: no symbol address in " KALLSYMS_PATH " (run as root)\n");
+        return -1;
+    }
+    qsort(syms, num_syms, sizeof(*syms), klfer_sym_cmp);
+    return 0;
+}
+
+/**
+ * Free kernel symbols
+ */
+void klfer_sym_unload(void)
+{
+    size_t i;
+
+    for(i=0; i<num_syms; i++)
+    {
+        free(syms[i].name);
+    }
+    free(syms);
+    syms = NULL;
+    num_syms = 0;
+}
+
+/**
+ * Resolve address to "symbol+offset [module]"
+ * @param[in] addr  Kernel address
+ * @param[out] *buf Destination
+ * @param[in] len   Size of buf
+ */
+void klfer_sym_resolve(unsigned long long addr, char *buf, size_t len)
+{
+    size_t lo = 0, hi = num_syms;
+    const char *mod;
+
+    /* last symbol whose address is not greater than addr */
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(syms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0)
+    {
+        snprintf(buf, len, "0x%llx", addr);
+        return;
+    }
+    mod = strchr(syms[lo - 1].name, ' ');
+    if(mod)
+        snprintf(buf, len, "%.*s+0x%llx%s", (int)(mod - syms[lo - 1].name), syms[lo - 1].name,
+                 addr - syms[lo - 1].addr, mod);
+    else
+        snprintf(buf, len, "%s+0x%llx", syms[lo - 1].name, addr - syms[lo - 1].addr);
+}
@@ -0,0 +1,14 @@
+/**
+ * @file  klfer_sym.h
+ * @brief Kernel symbol resolver of KLFER application
+ */
+#ifndef _KLFER_SYM_H_
+#define _KLFER_SYM_H_
+
+#include <stddef.h>
+
+int  klfer_sym_load(void);
+void klfer_sym_unload(void);
+void klfer_sym_resolve(unsigned long long addr, char *buf, size_t len);
+
+#endif /* _KLFER_SYM_H_ */
@@ -0,0 +1,134 @@
+/**
+ * @file  klfer_top.c
+ * @brief Live view of per-function counters of KLFER application
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "klfer_api.h"
+#include "klfer_top.h"
+
+/* Counters of a function during an interval */
+struct klfer_top_row {
+    int   func_idx;
+    __u64 calls;
+    __u64 total_ns;
+    __u64 max_ns;
+    __u64 dropped;
+};
+
+/**
+ * Compare rows by time spent in the interval (descending)
+ */
+static int klfer_top_cmp(const void *a, const void *b)
+{
+    const struct klfer_top_row *ra = a, *rb = b;
+
+    if(ra->total_ns != rb->total_ns) return (ra->total_ns < rb->total_ns) ? 1 : -1;
+    if(ra->calls != rb->calls) return (ra->calls < rb->calls) ? 1 : -1;
+    return ra->func_idx - rb->func_idx;
+}
+
+/**
+ * Sleep for the interval
+ * @param[in] interval Seconds
+ */
+static void klfer_top_sleep(double interval)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/**
+ * Print counters of the interval in place
+ * @param[in] *prev  Counters at the beginning of the interval
+ * @param[in] *cur   Counters at the end of the interval
+ */
+static void klfer_top_print(const struct klfer_stats *prev, const struct klfer_stats *cur)
+{
+    struct klfer_top_row rows[KLFER_MAX_FUNCS];
+    double sec = (cur->time - prev->time) / 1e9;
+    __u64 sum_ns = 0;
+    int i, num = 0;
+
+    for(i=0; i<cur->num_of_funcs; i++)
+    {
+        rows[num].func_idx = i;
+        rows[num].calls = cur->funcs[i].calls;
+        rows[num].total_ns = cur->funcs[i].total_ns;
+        rows[num].dropped = cur->funcs[i].dropped;
+        /* counters are cleared by reset (functions of another generation) */
+        if(i < prev->num_of_funcs && prev->generation == cur->generation)
+        {
+            rows[num].calls -= prev->funcs[i].calls;
+            rows[num].total_ns -= prev->funcs[i].total_ns;
+            rows[num].dropped -= prev->funcs[i].dropped;
+        }
+        rows[num].max_ns = cur->funcs[i].max_ns;
+        sum_ns += rows[num].total_ns;
+        num++;
+    }
+    qsort(rows, num, sizeof(rows[0]), klfer_top_cmp);
+
+    /* move cursor to home and clear screen */
+    printf("\033[H\033[2J");
+    printf("klferctl top - interval %.1f sec, %d functions", sec, num);
+    if(!(cur->state & (VALUE_BIT << LOGGER_CTRL_SHIFT)))
+    {
+        printf(" (Logger is disabled)");
+    }
+    printf("\n\n");
+    printf("%12s %12s %12s %7s %10s  %s\n", "Calls/s", "Avg(us)", "Max(us)", "Time%", "Drops/s", "function_name");
+    for(i=0; i<num; i++)
+    {
+        printf("%12.1f %12.3f %12.3f %7.2f %10.1f  %s\n",
+               (sec > 0) ? rows[i].calls / sec : 0.0,
+               rows[i].calls ? rows[i].total_ns / 1e3 / rows[i].calls : 0.0,
+               rows[i].max_ns / 1e3,
+               sum_ns ? rows[i].total_ns * 100.0 / sum_ns : 0.0,
+               (sec > 0) ? rows[i].dropped / sec : 0.0,
+               cur->func_names[rows[i].func_idx]);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Show calls/sec, average and max latency and time share of registered functions
+ * Max is the longest duration since the functions were registered.
+ * @param[in] fd   Device file
+ * @param[in] *cfg Interval and number of refreshes
+ * @retval  0 Success
+ * @retval -1 Error
+ */
+int klfer_top(int fd, const struct klfer_top_cfg *cfg)
+{
+    struct klfer_stats stats[2];
+    int cur = 0, n;
+
+    if(ioctl(fd, KLFER_GET_STATS, &stats[cur]) < 0)
+    {
+        perror("ioctl (stats)");
+        return -1;
+    }
+    for(n=0; cfg->count == 0 || n<cfg->count; n++)
+    {
+        klfer_top_sleep(cfg->interval);
+        cur ^= 1;
+        /* names and state come with the counters in one snapshot */
+        if(ioctl(fd, KLFER_GET_STATS, &stats[cur]) < 0)
+        {
+            perror("ioctl (stats)");
+            return -1;
+        }
+        klfer_top_print(&stats[cur ^ 1], &stats[cur]);
+    }
+    return 0;
+}
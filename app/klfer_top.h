@@ -0,0 +1,15 @@
+/**
+ * @file  klfer_top.h
+ * @brief Live view of per-function counters of KLFER application
+ */
+#ifndef _KLFER_TOP_H_
+#define _KLFER_TOP_H_
+
+struct klfer_top_cfg {
+    double interval;  // Refresh interval (sec)
+    int    count;     // Number of refreshes (0: until interrupted)
+};
+
+int klfer_top(int fd, const struct klfer_top_cfg *cfg);
+
+#endif /* _KLFER_TOP_H_ */
@@ -2,7 +2,10 @@
 #define _KLFER_API_H_
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
+#ifndef __KERNEL__
 #include <stdbool.h>
+#endif
 
 #define KLFER_IOC_TYPE ']'
 /* Device name */
@@ -14,25 +17,140 @@ enum klfer_cmd_flag {
     KLFER_SET_PARAMS_FLAG,
     KLFER_DUMP_SETTINGS_FLAG,
     KLFER_DUMP_LOGS_FLAG,
+    KLFER_SET_SESSION_FLAG,
+    KLFER_GET_INFO_FLAG,
+    KLFER_READ_LOGS_FLAG,
+    KLFER_RESIZE_BUF_FLAG,
+    KLFER_GET_STATS_FLAG,
+    KLFER_SET_STACK_FLAG,
+    KLFER_GET_STACK_FLAG,
+    KLFER_ARM_FUNCS_FLAG,
+    KLFER_CALIBRATE_FLAG,
 #ifdef DEBUG
     KLFER_SAMPLE_FLAG,
+    KLFER_SELFTEST_FLAG,
 #endif
 };
 
 #define MAX_STR_LEN 64
+#define MAX_PATH_LEN 256
+/* Same layout for 32-bit and 64-bit applications (__u64 first, no bool, explicit padding) */
 struct klfer_func_cfg {
-    char func_name [MAX_STR_LEN];
-    bool b_reg; // true: Register, false: Unregister
+    __u64 threshold_ns; // Paired-call record is logged only if the call takes this or longer
+    __u64 offset; // User function: file offset of the function in the binary
+    __u32 quota_pct; // Share of log stream per CPU reserved for the function (%, 0: no quota)
+    __u8  b_reg; // 1: Register, 0: Unregister
+    __u8  pad [3];
+    char func_name [MAX_STR_LEN]; // Kernel: [<module>:]<func> / User: <symbol>@<binary> (name in logs)
+    char path [MAX_PATH_LEN]; // User function: absolute path of binary ("": kernel function)
+};
+
+/* KLFER_REG_FUNC returns this if "<module>:<func>" is not found yet (armed when the module is loaded) */
+#define KLFER_REG_PENDING 1
+
+struct klfer_session_cfg {
+    char name [MAX_STR_LEN]; // Session name (created if it does not exist)
+};
+
+#define KLFER_MAX_FUNCS 16
+struct klfer_info {
+    __u32 state;            // Control parameters currently set (see below, UPDATE_FLAG is 0)
+    __u32 num_cpus;         // Number of per-CPU log streams
+    __u32 num_of_funcs;
+    __u32 log_fmt;          // KLFER_FMT_* (klfer_fmt.h)
+    __u32 stack_rate;       // Stack is captured for 1 of stack_rate calls (0: disabled)
+    __u32 disarmed;         // Functions which are registered but not logged (bit: function index)
+    __u64 buf_size;         // Bytes of log stream per CPU
+    __u64 time_offset;      // Add to timestamps to get realtime (nsec)
+    char  func_names [KLFER_MAX_FUNCS][MAX_STR_LEN];
+};
+
+struct klfer_read_cfg {
+    __u32 cpu;              // [in]  Log stream to be read
+    __u32 reserved;
+    __u64 offset;           // [in]  Offset in the stream
+    __u64 len;              // [in]  Size of buf / [out] Bytes copied
+    __u64 buf;              // [in]  Destination (pointer in user space)
+    __u64 committed;        // [out] Committed bytes of the stream
+    __u64 dropped;          // [out] Number of logs dropped on the CPU
+};
+
+/* Log2 histogram of durations: [i] counts calls of 2^(i-1) < duration <= 2^i nsec ([0]: <= 1 nsec),
+ * and the last one counts calls longer than 2^(KLFER_HIST_BUCKETS-2) nsec */
+#define KLFER_HIST_BUCKETS 32
+
+/* Counters of a function (calls which returned while the logger is enabled) */
+struct klfer_func_stat {
+    __u64 calls;
+    __u64 total_ns;         // Sum of durations
+    __u64 max_ns;           // Longest duration
+    __u64 dropped;          // Logs dropped for lack of space or quota, and returns whose entry is unknown
+    __u64 hist [KLFER_HIST_BUCKETS]; // Calls by duration
+};
+
+/* Counters, names and state are read at once, so a snapshot is self-consistent */
+struct klfer_stats {
+    __u64 time;             // Monotonic clock when counters are read (nsec)
+    __u64 generation;       // Changed when functions are reset (an index may be another function)
+    __u32 num_of_funcs;
+    __u32 state;            // Same as klfer_info.state
+    char  func_names [KLFER_MAX_FUNCS][MAX_STR_LEN];
+    struct klfer_func_stat funcs [KLFER_MAX_FUNCS]; // Sum of all CPUs
 };
 
+#define KLFER_STACK_DEPTH 16
+#define KLFER_MAX_STACKS  65536 // Upper limit of stack table (stack ID: 1..module parameter STACKS)
+struct klfer_stack_cfg {
+    __u32 stack_id;         // [in]  Stack ID in logs
+    __u32 nr_entries;       // [out] Number of return addresses
+    __u64 entries [KLFER_STACK_DEPTH]; // [out] Return addresses (the probed function first)
+};
+
+/* Functions armed / disarmed at once (bit: function index, a function in both masks is armed) */
+struct klfer_arm_cfg {
+    __u32 arm_mask;         // [in]  Functions to be logged again
+    __u32 disarm_mask;      // [in]  Functions not to be logged (probes stay registered)
+};
+
+/* Probe overhead measured by calling an empty function on each online CPU */
+struct klfer_calib_cfg {
+    __u32 loops;            // [in]  Calls of the empty function per CPU
+    __u32 num_cpus;         // [out] CPUs measured
+    __u64 min_ns;           // [out] Overhead per call of the fastest CPU
+    __u64 avg_ns;           // [out] Average of CPUs
+    __u64 max_ns;           // [out] Overhead per call of the slowest CPU
+};
+
+#ifdef DEBUG
+/**
+ * Self-test of logging path
+ *   Steady phase : Test functions are called on all online CPUs at once,
+ *                  and every record / drop is checked.
+ *   Churn phase  : Same load while parameters are toggled and the nested
+ *                  function is registered / unregistered, and records are checked.
+ */
+struct klfer_selftest_cfg {
+    __u32 loops;            // [in]  Calls of klfer_stress_func() per CPU in each phase
+    __u32 num_threads;      // [out] CPUs which called the test functions
+    __u64 expected;         // [out] Records to be logged or dropped (steady phase)
+    __u64 records;          // [out] Records logged (steady phase)
+    __u64 dropped;          // [out] Records dropped (steady phase)
+    __u64 churn_records;    // [out] Records logged (churn phase)
+    __u32 toggles;          // [out] Control operations (churn phase)
+    __u32 broken;           // [out] Torn / invalid / out of order records (both phases)
+    __u32 unpaired;         // [out] Entry / return pairing errors (steady phase)
+    __u32 miscounts;        // [out] Counter mismatches (steady phase)
+};
+#endif
+
 /**
  * Control parameters (int)
  *      3                   2                   1                   0
  *    1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0
  *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
- *   | X |                                               | C | B | A |
+ *   | X |                                   | F | E | D | C | B | A |
  *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
- *   Common(A-C):
+ *   Common(A-F):
  *      b0* > Setting is ignored (Keep the current setting)
  *   A: Logger Enable(1) / Disable(0)
  *      b11 > Enable Logger
@@ -43,6 +161,17 @@ struct klfer_func_cfg {
  *   C: Timestamp Enable(1) / Disable(0)
  *      b11 > Enable Timestamp
  *      b10 > Disable Timestamp
+ *   D: Compact log format Enable(1) / Disable(0) (logs are deleted when changed)
+ *      b11 > Enable Compact log format
+ *      b10 > Disable Compact log format
+ *   E: Paired-call record Enable(1) / Disable(0)
+ *      (One 'p' record at return instead of 'e' and 'r', if the call is not shorter than its threshold)
+ *      b11 > Enable Paired-call record
+ *      b10 > Disable Paired-call record
+ *   F: Overhead subtraction Enable(1) / Disable(0)
+ *      (Probe overhead measured by KLFER_CALIBRATE is subtracted from durations)
+ *      b11 > Enable Overhead subtraction
+ *      b10 > Disable Overhead subtraction
  *
  *   X: Timestamp format (Setting is ignored if timestamp update flag (Bit(5)) is 0.)
  *      b00 > Absolute time
@@ -60,6 +189,9 @@ struct klfer_func_cfg {
 #define LOGGER_CTRL_SHIFT      0
 #define JIT_CTRL_SHIFT         2
 #define TIMESTAMP_CTRL_SHIFT   4
+#define COMPACT_CTRL_SHIFT     6
+#define PAIRED_CTRL_SHIFT      8
+#define SUBTRACT_CTRL_SHIFT    10
 #define TIMESTAMP_FMT_SHIFT    30
 
 #define TS_FMT_MASK(param)     ((param >> TIMESTAMP_FMT_SHIFT) & 0b11)
@@ -74,6 +206,13 @@ struct klfer_func_cfg {
 #define DISABLE_JIT(param)     DISABLE_PARAM(param, JIT_CTRL_SHIFT)
 #define ENABLE_TS(param)       ENABLE_PARAM(param, TIMESTAMP_CTRL_SHIFT)
 #define DISABLE_TS(param)      DISABLE_PARAM(param, TIMESTAMP_CTRL_SHIFT)
+#define ENABLE_COMPACT(param)  ENABLE_PARAM(param, COMPACT_CTRL_SHIFT)
+#define DISABLE_COMPACT(param) DISABLE_PARAM(param, COMPACT_CTRL_SHIFT)
+#define ENABLE_PAIRED(param)   ENABLE_PARAM(param, PAIRED_CTRL_SHIFT)
+#define DISABLE_PAIRED(param)  DISABLE_PARAM(param, PAIRED_CTRL_SHIFT)
+#define ENABLE_SUBTRACT(param) ENABLE_PARAM(param, SUBTRACT_CTRL_SHIFT)
+#define DISABLE_SUBTRACT(param) \
+                               DISABLE_PARAM(param, SUBTRACT_CTRL_SHIFT)
 
 #define SET_TS_FMT_ABS(param)  (param = (param | (TS_FMT_ABS << TIMESTAMP_FMT_SHIFT)))
 #define SET_TS_FMT_RLTV_FIRST(param) \
@@ -87,8 +226,18 @@ struct klfer_func_cfg {
 #define KLFER_SET_PARAMS       _IOW(KLFER_IOC_TYPE, KLFER_SET_PARAMS_FLAG,    int)
 #define KLFER_DUMP_SETTINGS    _IOR(KLFER_IOC_TYPE, KLFER_DUMP_SETTINGS_FLAG, NULL)
 #define KLFER_DUMP_LOGS        _IOR(KLFER_IOC_TYPE, KLFER_DUMP_LOGS_FLAG,     NULL)
+#define KLFER_SET_SESSION      _IOW(KLFER_IOC_TYPE, KLFER_SET_SESSION_FLAG,   struct klfer_session_cfg)
+#define KLFER_GET_INFO         _IOR(KLFER_IOC_TYPE, KLFER_GET_INFO_FLAG,      struct klfer_info)
+#define KLFER_READ_LOGS        _IOWR(KLFER_IOC_TYPE, KLFER_READ_LOGS_FLAG,    struct klfer_read_cfg)
+#define KLFER_RESIZE_BUF       _IOW(KLFER_IOC_TYPE, KLFER_RESIZE_BUF_FLAG,    __u64)
+#define KLFER_GET_STATS        _IOR(KLFER_IOC_TYPE, KLFER_GET_STATS_FLAG,     struct klfer_stats)
+#define KLFER_SET_STACK        _IOW(KLFER_IOC_TYPE, KLFER_SET_STACK_FLAG,     __u32)
+#define KLFER_GET_STACK        _IOWR(KLFER_IOC_TYPE, KLFER_GET_STACK_FLAG,    struct klfer_stack_cfg)
+#define KLFER_ARM_FUNCS        _IOW(KLFER_IOC_TYPE, KLFER_ARM_FUNCS_FLAG,     struct klfer_arm_cfg)
+#define KLFER_CALIBRATE        _IOWR(KLFER_IOC_TYPE, KLFER_CALIBRATE_FLAG,    struct klfer_calib_cfg)
 #ifdef DEBUG
 #define KLFER_SAMPLE           _IOR(KLFER_IOC_TYPE, KLFER_SAMPLE_FLAG,        NULL)
+#define KLFER_SELFTEST         _IOWR(KLFER_IOC_TYPE, KLFER_SELFTEST_FLAG,     struct klfer_selftest_cfg)
 #endif
 
 #endif /* _KLFER_API_H_ */
@@ -0,0 +1,343 @@
+/**
+ * @file  klfer_fmt.h
+ * @brief Log stream format of KLFER (shared by LKM and application)
+ */
+#ifndef _KLFER_FMT_H_
+#define _KLFER_FMT_H_
+
+#include <linux/types.h>
+
+/**
+ * Log stream
+ *   Each CPU has its own stream. Timestamps in a stream never decrease,
+ *   except records logged while timestamp is disabled (time is 0).
+ *   FIXED   : Array of struct klfer_log
+ *   COMPACT : Variable length records (below)
+ *
+ * Compact record
+ *   A stream is divided into blocks of KLFER_BLOCK_SIZE bytes and every block
+ *   begins with a SYNC record, so decoding can start at any block boundary.
+ *     +--------+---------------------------------+
+ *     | tag(1) | payload                         |
+ *     +--------+---------------------------------+
+ *   tag:
+ *     0x00           PAD    : Rest of the block is unused
+ *     0x01           SYNC   : Absolute timestamp (8 bytes, little endian)
+ *     0x02           STACK  : stack_id(varint) of the event record which follows
+ *     0b01 + fid(6)  ENTRY  : [func_idx(1) if fid is 0x3F] delta(varint)
+ *     0b10 + fid(6)  RETURN : Same as ENTRY
+ *     0b11 + fid(6)  PAIR   : Same as ENTRY + duration(varint) pid(varint)
+ *   delta: Nanoseconds from the previous record of the stream (ULEB128)
+ *
+ *   Timestamp of PAIR record is the return time (entry time = time - duration).
+ *   A record without timestamp follows SYNC(0) unless the stream time is 0 already.
+ *   STACK and the event record are in the same block.
+ */
+#define KLFER_FMT_FIXED        0
+#define KLFER_FMT_COMPACT      1
+
+#define KLFER_BLOCK_SIZE       4096
+
+#define KLFER_TAG_PAD          0x00
+#define KLFER_TAG_SYNC         0x01
+#define KLFER_TAG_STACK        0x02
+#define KLFER_TAG_ENTRY        0x40
+#define KLFER_TAG_RETURN       0x80
+#define KLFER_TAG_PAIR         0xC0
+#define KLFER_TAG_KIND_MASK    0xC0
+#define KLFER_TAG_FID_MASK     0x3F
+#define KLFER_TAG_FID_ESC      0x3F
+
+#define KLFER_SYNC_LEN         9
+#define KLFER_VARINT_MAX_LEN   10
+#define KLFER_COMPACT_MAX_LEN  (3 + KLFER_VARINT_MAX_LEN * 4)
+
+/* Longest duration of FIXED format record (48 bits, about 78 hours; longer calls saturate) */
+#define KLFER_LOG_DURATION_MAX ((1ULL << 48) - 1)
+
+/* Record of FIXED format (24 bytes for every event, 'p' included) */
+struct klfer_log {
+    __u64 time;        // Timestamp (nsec, 0: timestamp disabled)
+    __u32 pid;         // Thread ID
+    __u32 stack_id;    // Stack trace of the call (0: not captured)
+    __u8  func_idx;    // Index of function in the session
+    char  event_id;    // 'e': Entry / 'r': Return / 'p': Paired call
+    __u16 duration_hi; // 'p': Nanoseconds from entry to return (bit 47-32)
+    __u32 duration_lo; // 'p': Nanoseconds from entry to return (bit 31-0)
+};
+
+/* Decoded event */
+struct klfer_event {
+    __u64 time;
+    __u64 duration;
+    __u32 pid;      // 0 for ENTRY / RETURN of COMPACT format
+    __u32 stack_id;
+    __u16 func_idx;
+    __u16 cpu;      // CPU of the stream
+    char  event_id;
+};
+
+/* Stream decoder */
+struct klfer_cursor {
+    const __u8 *data;
+    __u64 len;      // Committed bytes of the stream
+    __u64 pos;      // Read position
+    __u64 time;     // Timestamp of the previous record (COMPACT)
+    int   fmt;      // KLFER_FMT_*
+    int   cpu;      // CPU of the stream
+};
+
+static inline int klfer_varint_len(__u64 val)
+{
+    int len = 1;
+    while(val >= 0x80)
+    {
+        val >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static inline int klfer_put_varint(__u8 *p, __u64 val)
+{
+    int len = 0;
+    while(val >= 0x80)
+    {
+        p[len++] = (__u8)(val | 0x80);
+        val >>= 7;
+    }
+    p[len++] = (__u8)val;
+    return len;
+}
+
+static inline int klfer_get_varint(const __u8 *p, __u64 avail, __u64 *val)
+{
+    __u64 v = 0;
+    int shift = 0, len = 0;
+    while(len < (int)avail && len < KLFER_VARINT_MAX_LEN)
+    {
+        v |= (__u64)(p[len] & 0x7F) << shift;
+        if(!(p[len++] & 0x80))
+        {
+            *val = v;
+            return len;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+/**
+ * Length of compact event record
+ * @param[in] *ev   Event
+ * @param[in] delta Nanoseconds from the previous record
+ * @return Record length (bytes)
+ */
+static inline int klfer_compact_len(const struct klfer_event *ev, __u64 delta)
+{
+    int len = 1 + (ev->func_idx >= KLFER_TAG_FID_ESC ? 1 : 0) + klfer_varint_len(delta);
+    if(ev->event_id == 'p')
+    {
+        len += klfer_varint_len(ev->duration) + klfer_varint_len(ev->pid);
+    }
+    if(ev->stack_id)
+    {
+        len += 1 + klfer_varint_len(ev->stack_id);
+    }
+    return len;
+}
+
+/**
+ * Encode compact event record
+ * @param[out] *p   Destination (klfer_compact_len() bytes)
+ * @param[in] *ev   Event
+ * @param[in] delta Nanoseconds from the previous record
+ * @return Record length (bytes)
+ */
+static inline int klfer_put_compact(__u8 *p, const struct klfer_event *ev, __u64 delta)
+{
+    __u8 kind;
+    int len = 0;
+
+    switch(ev->event_id)
+    {
+    case 'e': kind = KLFER_TAG_ENTRY;  break;
+    case 'r': kind = KLFER_TAG_RETURN; break;
+    default:  kind = KLFER_TAG_PAIR;   break;
+    }
+    if(ev->stack_id)
+    {
+        p[len++] = KLFER_TAG_STACK;
+        len += klfer_put_varint(p + len, ev->stack_id);
+    }
+    if(ev->func_idx >= KLFER_TAG_FID_ESC)
+    {
+        p[len++] = kind | KLFER_TAG_FID_ESC;
+        p[len++] = (__u8)ev->func_idx;
+    }
+    else
+    {
+        p[len++] = kind | (__u8)ev->func_idx;
+    }
+    len += klfer_put_varint(p + len, delta);
+    if(kind == KLFER_TAG_PAIR)
+    {
+        len += klfer_put_varint(p + len, ev->duration);
+        len += klfer_put_varint(p + len, ev->pid);
+    }
+    return len;
+}
+
+static inline int klfer_put_sync(__u8 *p, __u64 time)
+{
+    int i;
+    p[0] = KLFER_TAG_SYNC;
+    for(i=0; i<8; i++)
+    {
+        p[1 + i] = (__u8)(time >> (8 * i));
+    }
+    return KLFER_SYNC_LEN;
+}
+
+/**
+ * Initialize stream decoder
+ * @param[out] *c   Cursor
+ * @param[in] *data Stream
+ * @param[in] len   Committed bytes of the stream
+ * @param[in] pos   Start position (COMPACT: rounded up to the next block)
+ * @param[in] fmt   KLFER_FMT_*
+ * @param[in] cpu   CPU of the stream
+ */
+static inline void klfer_cursor_init(struct klfer_cursor *c, const void *data, __u64 len, __u64 pos, int fmt, int cpu)
+{
+    c->data = (const __u8 *)data;
+    c->len = len;
+    c->fmt = fmt;
+    c->cpu = cpu;
+    c->time = 0;
+    if(fmt == KLFER_FMT_COMPACT)
+        c->pos = (pos + KLFER_BLOCK_SIZE - 1) / KLFER_BLOCK_SIZE * KLFER_BLOCK_SIZE;
+    else
+        c->pos = (pos + sizeof(struct klfer_log) - 1) / sizeof(struct klfer_log) * sizeof(struct klfer_log);
+}
+
+/**
+ * Decode event record
+ * @param[in,out] *c Cursor (pos is advanced only if the record is decoded)
+ * @param[out] *ev   Decoded event
+ * @param[in] pre    Bytes of prefix (STACK) before the event record
+ * @retval  1 Event is decoded
+ * @retval  0 End of stream
+ * @retval -1 Broken record
+ */
+static inline int klfer_decode_event(struct klfer_cursor *c, struct klfer_event *ev, int pre)
+{
+    const __u8 *p = c->data + c->pos + pre;
+    __u64 avail = c->len - c->pos - pre;
+    __u64 delta, val;
+    int i, len = 1;
+
+    switch(p[0] & KLFER_TAG_KIND_MASK)
+    {
+    case KLFER_TAG_ENTRY:  ev->event_id = 'e'; break;
+    case KLFER_TAG_RETURN: ev->event_id = 'r'; break;
+    default:               ev->event_id = 'p'; break;
+    }
+    ev->func_idx = p[0] & KLFER_TAG_FID_MASK;
+    ev->duration = 0;
+    ev->pid = 0;
+    if(ev->func_idx == KLFER_TAG_FID_ESC)
+    {
+        if(avail < 2) return 0;
+        ev->func_idx = p[len++];
+    }
+    i = klfer_get_varint(p + len, avail - len, &delta);
+    if(i < 0) goto SHORT;
+    len += i;
+    if(ev->event_id == 'p')
+    {
+        i = klfer_get_varint(p + len, avail - len, &ev->duration);
+        if(i < 0) goto SHORT;
+        len += i;
+        i = klfer_get_varint(p + len, avail - len, &val);
+        if(i < 0) goto SHORT;
+        len += i;
+        ev->pid = (__u32)val;
+    }
+    c->time += delta;
+    c->pos += pre + len;
+    ev->time = c->time;
+    return 1;
+SHORT:
+    /* record which is not committed completely is the end of stream */
+    return (len + KLFER_VARINT_MAX_LEN > avail) ? 0 : -1;
+}
+
+/**
+ * Decode next event
+ * @param[in,out] *c Cursor
+ * @param[out] *ev   Decoded event
+ * @retval  1 Event is decoded
+ * @retval  0 End of stream
+ * @retval -1 Broken record
+ */
+static inline int klfer_next_event(struct klfer_cursor *c, struct klfer_event *ev)
+{
+    const __u8 *p;
+    __u64 val;
+    int i;
+
+    ev->cpu = c->cpu;
+    if(c->fmt != KLFER_FMT_COMPACT)
+    {
+        const struct klfer_log *log;
+        if(c->pos + sizeof(*log) > c->len) return 0;
+        log = (const struct klfer_log *)(c->data + c->pos);
+        ev->time = log->time;
+        ev->duration = ((__u64)log->duration_hi << 32) | log->duration_lo;
+        ev->pid = log->pid;
+        ev->stack_id = log->stack_id;
+        ev->func_idx = log->func_idx;
+        ev->event_id = log->event_id;
+        c->pos += sizeof(*log);
+        return 1;
+    }
+
+    while(c->pos < c->len)
+    {
+        p = c->data + c->pos;
+        if(p[0] & KLFER_TAG_KIND_MASK)
+        {
+            ev->stack_id = 0;
+            return klfer_decode_event(c, ev, 0);
+        }
+        switch(p[0])
+        {
+        case KLFER_TAG_SYNC:
+            if(c->pos + KLFER_SYNC_LEN > c->len) return 0;
+            c->time = 0;
+            for(i=0; i<8; i++)
+            {
+                c->time |= (__u64)p[1 + i] << (8 * i);
+            }
+            c->pos += KLFER_SYNC_LEN;
+            break;
+        case KLFER_TAG_PAD:
+            c->pos = (c->pos / KLFER_BLOCK_SIZE + 1) * KLFER_BLOCK_SIZE;
+            break;
+        case KLFER_TAG_STACK:
+            /* decoded together with the following event record */
+            i = klfer_get_varint(p + 1, c->len - c->pos - 1, &val);
+            if(i < 0) return (1 + KLFER_VARINT_MAX_LEN > c->len - c->pos) ? 0 : -1;
+            if(c->pos + 1 + i >= c->len) return 0;
+            if(!(p[1 + i] & KLFER_TAG_KIND_MASK)) return -1;
+            ev->stack_id = (__u32)val;
+            return klfer_decode_event(c, ev, 1 + i);
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif /* _KLFER_FMT_H_ */
@@ -13,8 +13,23 @@
 #include <linux/time.h>
 #include <linux/kallsyms.h>
 #include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/firmware.h>
+#include <linux/notifier.h>
+#include <linux/timekeeping.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/stacktrace.h>
+#include <linux/uprobes.h>
+#include <linux/namei.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
 
 #include "klfer_api.h"
+#include "klfer_fmt.h"
 
 /* Module name / version */
 #define KLFER_MOD_NAME    "klfer"
@@ -26,22 +41,121 @@
 #define MINOR_BASE         0
 #define MINOR_NUM          1
 
-#define MAX_REG_FUNCS      16
+#define MAX_REG_FUNCS      KLFER_MAX_FUNCS
+#define MAX_SESSIONS       8
+#define MAX_PROBES         (MAX_REG_FUNCS * 2)
+#define UPROBE_MAX_ACTIVE  64       // Calls of a user function in flight (for duration)
+#define UPROBE_STALE_NS    (10 * NSEC_PER_SEC) // Slot older than this may be taken over if none is free
+#define UPROBE_SLOT_BUSY   (-1)     // Slot is being filled by an entry handler
 
 #define MAX_LOGS           1024
+#define MAX_STACKS         1024
+#define STACK_SKIP_MAX     8        // Room for frames of kprobes and KLFER in a captured stack
+#define STACK_PROBE_SLACK  8        // Max distance from the probed address to its frame
 
-struct klfer_reg_func
+#define DEFAULT_SESSION    "default"
+#define SELFTEST_SESSION   "klfer_selftest" // Private session of self-test (DEBUG)
+#define CALIB_SESSION      "klfer_calib"    // Private session of calibration
+#define CALIB_FUNC         "klfer_calib_func"
+#define CALIB_MAX_LOOPS    10000    // Log stream of calibration takes 64 bytes per call
+#define NO_FUNC_IDX        -1
+
+/* Session state flags (klfer_session.state) */
+#define SESS_F_LOGGING     (1 << 0) // Logger enable / disable
+#define SESS_F_JIT_LOG     (1 << 1) // JIT print log enable / disable
+#define SESS_F_TIMESTAMP   (1 << 2) // Timestamp enable / disable
+#define SESS_F_COMPACT     (1 << 3) // Compact log format enable / disable
+#define SESS_F_PAIRED      (1 << 4) // Paired-call record enable / disable
+#define SESS_F_SUBTRACT    (1 << 5) // Overhead subtraction enable / disable
+#define SESS_TS_FMT_SHIFT  8
+#define SESS_TS_FMT(state) ((state >> SESS_TS_FMT_SHIFT) & 0b11)
+
+/**
+ * Sessions subscribing a probe
+ * Replaced as a whole under ctrl_lock and read by the handlers under RCU.
+ */
+struct klfer_probe_subs
+{
+    int                   sess_func_idx[MAX_SESSIONS]; // Function index in each session (or NO_FUNC_IDX)
+    struct rcu_head       rcu;
+};
+
+/* Call of user function in flight (pid 0: free slot) */
+struct klfer_ucall
+{
+    pid_t                 pid;         // Thread of the call (0: free, UPROBE_SLOT_BUSY: being filled)
+    u64                   start_time;  // Start time of the thread (pid may be reused)
+    u64                   entry_time;
+};
+
+/* kretprobe (or uprobe) shared by all sessions which register the same function */
+struct klfer_probe
 {
     struct kretprobe      krp;
+    struct uprobe_consumer uc;         // User function (b_user)
+    struct inode          *inode;      // Binary of user function
+    loff_t                offset;      // File offset of user function
+    struct klfer_ucall    ucalls[UPROBE_MAX_ACTIVE]; // Entry time of user function (no instance data)
+    bool                  b_user;
+    char                  func_name[MAX_STR_LEN];
+    int                   refcnt;      // Number of sessions using this probe
+    struct klfer_probe_subs __rcu *subs;
+    bool                  b_disabled;  // kretprobe is disabled (all subscribers are disarmed)
+};
+
+/* Per-call data of kretprobe instance (kretprobe.data_size) */
+struct klfer_ri_data
+{
+    u64                   entry_time;  // Monotonic clock at function entry (nsec)
+    unsigned int          stack_sessions; // Sessions which sampled the stack (bit: session index)
+    unsigned int          nr_entries;
+    unsigned long         entries[KLFER_STACK_DEPTH + STACK_SKIP_MAX]; // Stack at function entry
+};
+
+struct klfer_reg_func
+{
+    struct klfer_probe    *probe;
     char                  func_name[MAX_STR_LEN];
+    u64                   threshold_ns; // Minimum duration of paired-call record (nsec)
+    unsigned int          quota_pct;   // Share of log stream per CPU reserved for the function (%)
     bool                  b_registered;
+    bool                  b_pending;   // Waiting for the module of the function to be loaded
+    char                  pending_mod[MODULE_NAME_LEN]; // Module whose loading arms the pending function
 };
 
-struct klfer_log
+/* Log stream of one CPU (written only by the owner CPU with IRQs disabled) */
+struct klfer_cpu_buf
 {
-    struct timespec       time;
-    int                   func_idx;
-    char                  event_id;
+    u8                    *data;
+    size_t                size;        // Bytes
+    size_t                head;        // Committed bytes (published with smp_store_release)
+    u64                   last_time;   // Timestamp of the last record (COMPACT delta base)
+    u64                   first_time;  // Timestamp of the first record (JIT print log)
+    unsigned long         dropped;     // Number of logs dropped for lack of space
+    struct klfer_func_stat stats[MAX_REG_FUNCS]; // Per-function counters (updated at return)
+    size_t                used[MAX_REG_FUNCS]; // Bytes written by each function
+    unsigned int          stack_seq;   // Calls counted for stack sampling
+    u64                   overhead_ns; // Probe overhead per call measured on the CPU (0: not measured)
+};
+
+/* Tracing session (independent functions, logs and parameters) */
+struct klfer_session
+{
+    char                  name[MAX_STR_LEN];
+    bool                  b_used;
+    bool                  b_private;   // Used by self-test / calibration (not attached to files)
+    int                   users;       // Number of open files attached to this session
+    struct klfer_reg_func funcs[MAX_REG_FUNCS];
+    struct klfer_cpu_buf __percpu *bufs;
+    size_t                buf_size;    // Bytes of log stream per CPU
+    unsigned int          stack_rate;  // Capture stack of 1 of stack_rate calls on each CPU (0: disabled)
+    u32                   disarmed;    // Registered functions not to be logged (bit: function index)
+    u32                   quota_mask;  // Registered functions with quota (bit: function index)
+    u64                   time_offset; // Realtime - monotonic clock (nsec) when logs were reset
+    int                   num_of_funcs;
+    u64                   generation;  // Changed by reset of functions (see klfer_stats)
+    atomic_t              jit_seq;     // Sequence number of JIT print log
+    atomic_t              state;       // SESS_F_* flags and timestamp format
 };
 
 struct klfer_mod_data
@@ -50,15 +164,10 @@ struct klfer_mod_data
     struct class          *pclass;
     struct device         *pdev;
     struct cdev           chrdev;
-    struct klfer_reg_func funcs[MAX_REG_FUNCS];
-    struct klfer_log      *logs;
-    int                   num_of_funcs;
-    int                   num_of_logs;
-    atomic_t              open_available;
-    bool                  b_logging;   // Logger enable / disable
-    bool                  b_jit_log;   // JIT print log enable / disable
-    bool                  b_timestamp; // Timestamp enable / disable
-    char                  timestamp_fmt;
+    struct mutex          ctrl_lock;   // Serializes control operations (ioctl, open, close)
+    struct klfer_probe    probes[MAX_PROBES];
+    struct klfer_session  sessions[MAX_SESSIONS];
+    u64                   generation;  // Last generation given to a session
 };
 
 #endif /* _KLFER_H_ */
@@ -24,3 +24,121 @@ void klfer_sample_nested_func(void)
 }
 EXPORT_SYMBOL(klfer_sample_nested_func);
 
+/**
+ * Targets of self-test
+ *   Same call pattern as the sample functions without printk, so the CPUs
+ *   contend on the handlers and the log streams rather than the console.
+ */
+noinline int klfer_stress_func(void)
+{
+    int i;
+    for(i=0; i<5; i++)
+    {
+        klfer_stress_nested_func();
+    }
+    return KLFER_OK;
+}
+
+noinline void klfer_stress_nested_func(void)
+{
+    barrier();
+}
+
+
+/**
+ * Load generator of self-test
+ *   One kthread bound to each online CPU calls klfer_stress_func() loops times,
+ *   then sleeps until it is stopped.
+ */
+static struct task_struct **stressTasks;
+static atomic_t stressRunning;
+static unsigned int stressLoops;
+
+static int klfer_stress_thread(void *arg)
+{
+    unsigned int i;
+
+    for(i=0; i<stressLoops && !kthread_should_stop(); i++)
+    {
+        klfer_stress_func();
+        cond_resched();
+    }
+    atomic_dec(&stressRunning);
+    while(!kthread_should_stop())
+    {
+        msleep(1);
+    }
+    return KLFER_OK;
+}
+
+/**
+ * Start load generator
+ * @param[in] loops Calls of klfer_stress_func() on each CPU
+ * @retval >0       Number of CPUs which call the target functions
+ * @retval -ENOBUFS Failed to kmalloc
+ * @retval -ENOMEM  No kthread is created
+ */
+int klfer_stress_start(unsigned int loops)
+{
+    struct task_struct *task;
+    int cpu, num = 0;
+
+    stressTasks = kcalloc(nr_cpu_ids, sizeof(*stressTasks), GFP_KERNEL);
+    if(!stressTasks)
+    {
+        return -ENOBUFS;
+    }
+    stressLoops = loops;
+    atomic_set(&stressRunning, 0);
+    for_each_online_cpu(cpu)
+    {
+        task = kthread_create(klfer_stress_thread, NULL, "klfer_stress/%d", cpu);
+        if(IS_ERR(task))
+        {
+            pr_err("Err: failed to create kthread for cpu%d\n", cpu);
+            continue;
+        }
+        kthread_bind(task, cpu);
+        stressTasks[cpu] = task;
+        atomic_inc(&stressRunning);
+        num++;
+    }
+    if(num == 0)
+    {
+        kfree(stressTasks);
+        stressTasks = NULL;
+        return -ENOMEM;
+    }
+    /* all threads are counted before any of them finishes */
+    for(cpu=0; cpu<nr_cpu_ids; cpu++)
+    {
+        if(stressTasks[cpu]) wake_up_process(stressTasks[cpu]);
+    }
+    return num;
+}
+
+/**
+ * Check if load generator is still calling the target functions
+ * @retval true  Running
+ * @retval false All threads finished their loops
+ */
+bool klfer_stress_running(void)
+{
+    return atomic_read(&stressRunning) > 0;
+}
+
+/**
+ * Stop load generator (wait for all threads to exit)
+ */
+void klfer_stress_stop(void)
+{
+    int cpu;
+
+    if(!stressTasks) return;
+    for(cpu=0; cpu<nr_cpu_ids; cpu++)
+    {
+        if(stressTasks[cpu]) kthread_stop(stressTasks[cpu]);
+    }
+    kfree(stressTasks);
+    stressTasks = NULL;
+}
@@ -3,5 +3,10 @@
 
 int  klfer_sample_func(void);
 void klfer_sample_nested_func(void);
+int  klfer_stress_func(void);
+void klfer_stress_nested_func(void);
+int  klfer_stress_start(unsigned int);
+bool klfer_stress_running(void);
+void klfer_stress_stop(void);
 
 #endif /* _KLFER_DBG_H_ */
@@ -4,21 +4,58 @@
  */
 
 #include "klfer.h"
+#include "klfer_stack.h"
 #ifdef DEBUG
 #include "klfer_dbg.h"
 #endif
 
-static inline void klfer_unregister_kretprobe(int);
+static struct klfer_probe_subs *klfer_alloc_subs(void);
+static struct klfer_probe *klfer_get_probe(const char *);
+static struct klfer_probe *klfer_get_uprobe(const struct klfer_func_cfg *);
+static void klfer_put_probe(struct klfer_probe *);
+static int  klfer_update_subs(struct klfer_probe *, int, int);
+static inline void klfer_unregister_kretprobe(struct klfer_session *, int);
 static int  klfer_entry_handler(struct kretprobe_instance *, struct pt_regs *);
 static int  klfer_ret_handler(struct kretprobe_instance *, struct pt_regs *);
-static int  klfer_log(const char *, char);
-static int  klfer_register_func(struct klfer_func_cfg *);
-static int  klfer_unregister_func(struct klfer_func_cfg *);
-static void klfer_reset_funcs(void);
-static int  klfer_set_params(int);
-static void klfer_dump_settings(void);
-static void klfer_print_log(int);
-static void klfer_dump_logs(int, int);
+static int  klfer_uentry_handler(struct uprobe_consumer *, struct pt_regs *);
+static int  klfer_uret_handler(struct uprobe_consumer *, unsigned long, struct pt_regs *);
+static void klfer_fanout(struct klfer_probe *, struct klfer_ri_data *, char);
+static void klfer_save_stack(struct klfer_probe *, struct klfer_ri_data *);
+static int  klfer_log(struct klfer_session *, struct klfer_event *, int);
+static size_t klfer_log_limit(struct klfer_session *, struct klfer_cpu_buf *, int);
+static int  klfer_put_log(struct klfer_cpu_buf *, struct klfer_event *, int, size_t);
+static void klfer_count(struct klfer_session *, int, u64);
+static void klfer_count_drop(struct klfer_session *, int);
+static int  klfer_register_func(struct klfer_session *, struct klfer_func_cfg *);
+static int  klfer_arm_func(struct klfer_session *, int);
+static int  klfer_attach_probe(struct klfer_session *, int, struct klfer_probe *);
+static void klfer_sync_probe(struct klfer_probe *);
+static int  klfer_arm_funcs(struct klfer_session *, struct klfer_arm_cfg *);
+static int  klfer_unregister_func(struct klfer_session *, struct klfer_func_cfg *);
+static void klfer_arm_pending(struct module *);
+static void klfer_disarm_module(struct module *, bool);
+static int  klfer_module_notify(struct notifier_block *, unsigned long, void *);
+static void klfer_register_list(char *);
+static void klfer_load_probe_list(void);
+static void klfer_reset_funcs(struct klfer_session *);
+static void klfer_reset_logs(struct klfer_session *);
+static int  klfer_quiesce(struct klfer_session *);
+static int  klfer_set_params(struct klfer_session *, int);
+static void klfer_dump_settings(struct klfer_session *);
+static s64  klfer_event_time(struct klfer_session *, int, struct klfer_event *, u64, u64);
+static void klfer_print_event(struct klfer_session *, int, struct klfer_event *, s64, int);
+static void klfer_dump_drops(struct klfer_session *);
+static void klfer_dump_logs(struct klfer_session *);
+static u32  klfer_info_state(int);
+static void klfer_get_info(struct klfer_session *, struct klfer_info *);
+static int  klfer_read_logs(struct klfer_session *, struct klfer_read_cfg *);
+static void klfer_get_stats(struct klfer_session *, struct klfer_stats *);
+static int  klfer_alloc_bufs(struct klfer_session *, size_t);
+static int  klfer_resize_bufs(struct klfer_session *, size_t);
+static void klfer_free_bufs(struct klfer_session *);
+static int  klfer_init_session(struct klfer_session *, const char *);
+static void klfer_teardown_session(struct klfer_session *);
+static struct klfer_session *klfer_attach_session(struct klfer_session *, const char *);
 static int  klfer_init_mod_data(void);
 static void klfer_teardown_mod_data(void);
 static int  klfer_open(struct inode *, struct file *);
@@ -26,19 +63,49 @@ static int  klfer_close(struct inode *, struct file *);
 static long klfer_ioctl(struct file *, unsigned int, unsigned long);
 static int  klfer_create_dev(void);
 static void klfer_delete_dev(void);
+static void klfer_calib_func(void);
+static void klfer_calib_run(void *);
+static int  klfer_calibrate(struct klfer_session *, struct klfer_calib_cfg *);
+#ifdef DEBUG
+static int  klfer_selftest(struct klfer_selftest_cfg *);
+static void klfer_selftest_toggle(struct klfer_session *, unsigned int);
+static void klfer_selftest_check(struct klfer_session *, bool, struct klfer_selftest_cfg *);
+#endif
 
 /**
  * Module parameter
  */
 static int MLOGS = MAX_LOGS;
 module_param(MLOGS, int, S_IRUGO);
-MODULE_PARM_DESC(MLOGS, "Max number of logs to be saved.");
+MODULE_PARM_DESC(MLOGS, "Max number of logs to be saved per CPU in fixed format (per session).");
+static char *FUNCS[MAX_REG_FUNCS];
+static int NFUNCS;
+module_param_array(FUNCS, charp, &NFUNCS, S_IRUGO);
+MODULE_PARM_DESC(FUNCS, "Functions to be registered to the default session at load ([<module>:]<func>,...).");
+static char *FUNCS_FILE;
+module_param(FUNCS_FILE, charp, S_IRUGO);
+MODULE_PARM_DESC(FUNCS_FILE, "Firmware file listing functions to be registered at load (one per line).");
+static bool LOGGER;
+module_param(LOGGER, bool, S_IRUGO);
+MODULE_PARM_DESC(LOGGER, "Enable logger of the default session at load.");
+static int STACKS = MAX_STACKS;
+module_param(STACKS, int, S_IRUGO);
+MODULE_PARM_DESC(STACKS, "Max number of unique stack traces to be saved (shared by sessions, up to 65536).");
 
 /**
  * Module data info
  */
 struct klfer_mod_data modData;
 
+#define SESSION_IDX(sess)  ((int)((sess) - modData.sessions))
+
+/**
+ * Module notifier (arm pending functions in modules loaded later)
+ */
+static struct notifier_block klfer_module_nb = {
+    .notifier_call = klfer_module_notify,
+};
+
 /**
  * handler table
  */
@@ -50,17 +117,250 @@ struct file_operations klfer_fops = {
     .compat_ioctl   = klfer_ioctl, // for 32-bit App
 };
 
+/**
+ * Allocate subscription which no session subscribes yet
+ * @return Pointer to the subscription, or NULL if failed to kmalloc
+ */
+static struct klfer_probe_subs *klfer_alloc_subs(void)
+{
+    struct klfer_probe_subs *subs;
+    int sess_idx;
+
+    /* No session subscribes until klfer_update_subs() publishes it */
+    subs = kmalloc(sizeof(*subs), GFP_KERNEL);
+    if(!subs)
+    {
+        return NULL;
+    }
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
+    {
+        subs->sess_func_idx[sess_idx] = NO_FUNC_IDX;
+    }
+    return subs;
+}
+
+/**
+ * Get kretprobe for the function (register it if no session uses it yet)
+ * @param[in] *func_name Function name
+ * @return Pointer to the probe, or ERR_PTR() on error
+ */
+static struct klfer_probe *klfer_get_probe(const char *func_name)
+{
+    struct klfer_probe *probe = NULL;
+    struct klfer_probe_subs *subs;
+    int probe_idx, ret;
+
+    for(probe_idx=0; probe_idx<MAX_PROBES; probe_idx++)
+    {
+        if(modData.probes[probe_idx].refcnt > 0)
+        {
+            if(!modData.probes[probe_idx].b_user &&
+               strcmp(modData.probes[probe_idx].func_name, func_name) == 0)
+            {
+                modData.probes[probe_idx].refcnt++;
+                return &modData.probes[probe_idx];
+            }
+        }
+        else if(!probe)
+        {
+            probe = &modData.probes[probe_idx];
+        }
+    }
+    if(!probe)
+    {
+        pr_err("Too many probes registered.\n");
+        return ERR_PTR(-ENOBUFS);
+    }
+
+    subs = klfer_alloc_subs();
+    if(!subs)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    RCU_INIT_POINTER(probe->subs, subs);
+
+    probe->b_user = false;
+    probe->b_disabled = false;
+    memset(&probe->krp, 0, sizeof(probe->krp));
+    strcpy(probe->func_name, func_name);
+    probe->krp.kp.symbol_name = probe->func_name;
+    probe->krp.handler = klfer_ret_handler;
+    probe->krp.entry_handler = klfer_entry_handler;
+    probe->krp.data_size = sizeof(struct klfer_ri_data);
+    probe->krp.maxactive = 20;
+    ret = register_kretprobe(&probe->krp);
+    if(ret < 0)
+    {
+        pr_err("register_kretprobe() failed. > %s() (returned: %d)\n", func_name, ret);
+        RCU_INIT_POINTER(probe->subs, NULL);
+        kfree(subs);
+        return ERR_PTR(ret);
+    }
+    probe->refcnt = 1;
+    pr_info("Register return probe at %s: %p\n", probe->krp.kp.symbol_name, probe->krp.kp.addr);
+    return probe;
+}
+
+/**
+ * Get uprobe for the user function (register it if no session uses it yet)
+ * Probes of the same binary and offset are shared regardless of the name.
+ * @param[in] *cfg Configurations for registration (path and offset are set)
+ * @return Pointer to the probe, or ERR_PTR() on error
+ */
+static struct klfer_probe *klfer_get_uprobe(const struct klfer_func_cfg *cfg)
+{
+    struct klfer_probe *probe = NULL;
+    struct klfer_probe_subs *subs;
+    struct inode *inode;
+    struct path path;
+    int probe_idx, ret;
+
+    ret = kern_path(cfg->path, LOOKUP_FOLLOW, &path);
+    if(ret)
+    {
+        pr_err("Err: %s is not found.\n", cfg->path);
+        return ERR_PTR(ret);
+    }
+    inode = igrab(d_real_inode(path.dentry));
+    path_put(&path);
+    if(!inode)
+    {
+        return ERR_PTR(-ENOENT);
+    }
+    if(!S_ISREG(inode->i_mode))
+    {
+        pr_err("Err: %s is not a regular file.\n", cfg->path);
+        ret = -EINVAL;
+        goto ERR;
+    }
+
+    for(probe_idx=0; probe_idx<MAX_PROBES; probe_idx++)
+    {
+        if(modData.probes[probe_idx].refcnt > 0)
+        {
+            if(modData.probes[probe_idx].b_user && modData.probes[probe_idx].inode == inode &&
+               modData.probes[probe_idx].offset == cfg->offset)
+            {
+                modData.probes[probe_idx].refcnt++;
+                iput(inode);
+                return &modData.probes[probe_idx];
+            }
+        }
+        else if(!probe)
+        {
+            probe = &modData.probes[probe_idx];
+        }
+    }
+    if(!probe)
+    {
+        pr_err("Too many probes registered.\n");
+        ret = -ENOBUFS;
+        goto ERR;
+    }
+
+    subs = klfer_alloc_subs();
+    if(!subs)
+    {
+        ret = -ENOMEM;
+        goto ERR;
+    }
+    RCU_INIT_POINTER(probe->subs, subs);
+
+    probe->b_user = true;
+    probe->b_disabled = false;
+    probe->inode = inode;
+    probe->offset = cfg->offset;
+    memset(probe->ucalls, 0, sizeof(probe->ucalls));
+    memset(&probe->uc, 0, sizeof(probe->uc));
+    strcpy(probe->func_name, cfg->func_name);
+    probe->uc.handler = klfer_uentry_handler;
+    probe->uc.ret_handler = klfer_uret_handler;
+    ret = uprobe_register(inode, cfg->offset, &probe->uc);
+    if(ret < 0)
+    {
+        pr_err("uprobe_register() failed. > %s (returned: %d)\n", cfg->func_name, ret);
+        RCU_INIT_POINTER(probe->subs, NULL);
+        kfree(subs);
+        goto ERR;
+    }
+    probe->refcnt = 1;
+    pr_info("Register return uprobe at %s+0x%llx: %s\n", cfg->path, (u64)cfg->offset, cfg->func_name);
+    return probe;
+ERR:
+    iput(inode);
+    return ERR_PTR(ret);
+}
+
+/**
+ * Put kretprobe or uprobe (unregister it if no session uses it any more)
+ * @param[in] *probe Probe
+ */
+static void klfer_put_probe(struct klfer_probe *probe)
+{
+    struct klfer_probe_subs *subs;
+
+    if(--probe->refcnt > 0) return;
+    /* unregister_kretprobe() / uprobe_unregister() wait for running handlers, so subs can be freed directly */
+    if(probe->b_user)
+    {
+        uprobe_unregister(probe->inode, probe->offset, &probe->uc);
+        iput(probe->inode);
+        probe->inode = NULL;
+        pr_info("Unregister return uprobe: %s\n", probe->func_name);
+    }
+    else
+    {
+        unregister_kretprobe(&probe->krp);
+        pr_info("Unregister return probe at %s: %p\n", probe->krp.kp.symbol_name, probe->krp.kp.addr);
+    }
+    subs = rcu_dereference_protected(probe->subs, lockdep_is_held(&modData.ctrl_lock));
+    RCU_INIT_POINTER(probe->subs, NULL);
+    kfree(subs);
+}
+
+/**
+ * Publish new subscription of a session to the probe
+ * @param[in] *probe   Probe
+ * @param[in] sess_idx Session index
+ * @param[in] func_idx Function index in the session (NO_FUNC_IDX: unsubscribe)
+ * @retval KLFER_OK Success
+ * @retval -ENOMEM  Failed to kmalloc (never for unsubscribe)
+ */
+static int klfer_update_subs(struct klfer_probe *probe, int sess_idx, int func_idx)
+{
+    struct klfer_probe_subs *old, *new;
+
+    old = rcu_dereference_protected(probe->subs, lockdep_is_held(&modData.ctrl_lock));
+    new = kmalloc(sizeof(*new), GFP_KERNEL);
+    if(!new)
+    {
+        if(func_idx != NO_FUNC_IDX) return -ENOMEM;
+        /* Clearing one entry is a single store, so unsubscribe can be done in place */
+        WRITE_ONCE(old->sess_func_idx[sess_idx], NO_FUNC_IDX);
+        return KLFER_OK;
+    }
+    memcpy(new->sess_func_idx, old->sess_func_idx, sizeof(new->sess_func_idx));
+    new->sess_func_idx[sess_idx] = func_idx;
+    rcu_assign_pointer(probe->subs, new);
+    kfree_rcu(old, rcu);
+    return KLFER_OK;
+}
+
 /**
  * Unregister function registered by kretprobe
+ * @param[in] *sess    Session
  * @param[in] func_idx Index of function
  */
-static inline void klfer_unregister_kretprobe(int func_idx)
+static inline void klfer_unregister_kretprobe(struct klfer_session *sess, int func_idx)
 {
-    unregister_kretprobe(&modData.funcs[func_idx].krp);
-    modData.funcs[func_idx].b_registered = false;
-    pr_info("Unregister return probe at %s: %p\n",
-            modData.funcs[func_idx].krp.kp.symbol_name,
-            modData.funcs[func_idx].krp.kp.addr);
+    struct klfer_probe *probe = sess->funcs[func_idx].probe;
+
+    klfer_update_subs(probe, SESSION_IDX(sess), NO_FUNC_IDX);
+    sess->funcs[func_idx].b_registered = false;
+    sess->funcs[func_idx].probe = NULL;
+    /* other sessions may have disarmed it */
+    if(probe->refcnt > 1) klfer_sync_probe(probe);
+    klfer_put_probe(probe);
 }
 
 /**
@@ -68,11 +368,11 @@ static inline void klfer_unregister_kretprobe(int func_idx)
  * @param[in] *ri   kretprobe instance
  * @param[in] *regs Not used
  * @retval KLFER_OK  Success
- * @retval KLFER_Err Error
  */
 static int  klfer_entry_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-    return (modData.b_logging ? klfer_log(ri->rp->kp.symbol_name, 'e') : KLFER_OK);
+    klfer_fanout(container_of(ri->rp, struct klfer_probe, krp), (struct klfer_ri_data *)ri->data, 'e');
+    return KLFER_OK;
 }
 
 /**
@@ -80,105 +380,516 @@ static int  klfer_entry_handler(struct kretprobe_instance *ri, struct pt_regs *r
  * @param[in] *ri   kretprobe instance
  * @param[in] *regs Not used
  * @retval KLFER_OK  Success
- * @retval KLFER_Err Error
  */
 static int klfer_ret_handler(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-    return (modData.b_logging ? klfer_log(ri->rp->kp.symbol_name, 'r') : KLFER_OK);
+    klfer_fanout(container_of(ri->rp, struct klfer_probe, krp), (struct klfer_ri_data *)ri->data, 'r');
+    return KLFER_OK;
 }
 
 /**
- * Logger function
- * @param[in] *func_name Called function name
- * @param[in] event_id   Event ID ('e': Entry / 'r': Return)
+ * Handler function to be called when the registered user function is called
+ * uprobe has no per-call data, so entry time is kept in a free slot of the probe.
+ * The slot is claimed (UPROBE_SLOT_BUSY) before the entry is logged, and its
+ * fields are published with the pid of the thread. A slot is freed by the
+ * return of the call. Slots of calls which never return (the thread exited,
+ * longjmp, exec) are taken over when they get old. If no slot is available,
+ * the entry is not logged and the return is counted as dropped.
+ * @param[in] *uc   uprobe consumer
+ * @param[in] *regs Not used
+ * @retval KLFER_OK  Success (keep the probe)
+ */
+static int klfer_uentry_handler(struct uprobe_consumer *uc, struct pt_regs *regs)
+{
+    struct klfer_probe *probe = container_of(uc, struct klfer_probe, uc);
+    struct klfer_ri_data data;
+    u64 now = ktime_get_ns(), entry_time, oldest = 0;
+    pid_t pid;
+    int i, stale = -1;
+
+    for(i=0; i<UPROBE_MAX_ACTIVE; i++)
+    {
+        pid = READ_ONCE(probe->ucalls[i].pid);
+        if(pid == 0 && cmpxchg(&probe->ucalls[i].pid, 0, UPROBE_SLOT_BUSY) == 0) break;
+        entry_time = READ_ONCE(probe->ucalls[i].entry_time);
+        if(pid > 0 && entry_time + UPROBE_STALE_NS < now && (stale < 0 || entry_time < oldest))
+        {
+            stale = i;
+            oldest = entry_time;
+        }
+    }
+    if(i == UPROBE_MAX_ACTIVE && stale >= 0)
+    {
+        /* take over the oldest stale slot unless its owner returned in the meantime */
+        pid = READ_ONCE(probe->ucalls[stale].pid);
+        if(pid > 0 && cmpxchg(&probe->ucalls[stale].pid, pid, UPROBE_SLOT_BUSY) == pid) i = stale;
+    }
+    if(i == UPROBE_MAX_ACTIVE) return KLFER_OK;
+
+    /* handlers of uprobe are preemptible, but a record must be written on the CPU which read the clock */
+    preempt_disable();
+    klfer_fanout(probe, &data, 'e');
+    preempt_enable();
+    probe->ucalls[i].start_time = current->start_time;
+    WRITE_ONCE(probe->ucalls[i].entry_time, data.entry_time);
+    /* fields are visible before the slot is owned (pairs with smp_load_acquire() in klfer_uret_handler()) */
+    smp_store_release(&probe->ucalls[i].pid, current->pid);
+    return KLFER_OK;
+}
+
+/**
+ * Handler function to be called when the registered user function returns
+ * The latest call of the thread is the one which returns (recursive calls).
+ * If the entry was not tracked (no free slot, or taken over), the return is
+ * not logged and counted as dropped.
+ * @param[in] *uc   uprobe consumer
+ * @param[in] func  Not used
+ * @param[in] *regs Not used
  * @retval KLFER_OK  Success
- * @retval KLFER_Err Error
  */
-static int klfer_log(const char *func_name, char event_id)
+static int klfer_uret_handler(struct uprobe_consumer *uc, unsigned long func, struct pt_regs *regs)
 {
-    int func_idx;
+    struct klfer_probe *probe = container_of(uc, struct klfer_probe, uc);
+    struct klfer_ri_data data;
+    u64 entry_time;
+    int i, slot = -1;
 
-    if(modData.num_of_logs >= MAX_LOGS)
+    data.entry_time = 0;
+    data.stack_sessions = 0;
+    for(i=0; i<UPROBE_MAX_ACTIVE; i++)
     {
-        pr_err("Err: No log space - %s\n", func_name);
-        return KLFER_ERR;
+        if(smp_load_acquire(&probe->ucalls[i].pid) != current->pid) continue;
+        entry_time = READ_ONCE(probe->ucalls[i].entry_time);
+        if(probe->ucalls[i].start_time == current->start_time && entry_time >= data.entry_time)
+        {
+            data.entry_time = entry_time;
+            slot = i;
+        }
+    }
+    /* the slot may have been taken over while its fields were read */
+    if(slot >= 0 && cmpxchg(&probe->ucalls[slot].pid, current->pid, 0) != current->pid)
+    {
+        data.entry_time = 0;
+    }
+    preempt_disable();
+    klfer_fanout(probe, &data, 'r');
+    preempt_enable();
+    return KLFER_OK;
+}
+
+/**
+ * Log an event to every session which registers the probed function
+ * The clock is read once per event and shared by all sessions. Entry time is
+ * kept in the kretprobe instance, so a session in paired-call mode writes one
+ * record at return only if the call took threshold_ns or longer.
+ * Stack is captured at entry for sampled calls, and stored to the stack table
+ * at return only if the call took threshold_ns or longer (kernel functions only).
+ * If the session subtracts overhead, the duration is reduced before it is
+ * counted, compared with threshold_ns and logged.
+ * @param[in] *probe    Probe
+ * @param[in,out] *data Per-call data (entry_time 0 at return: unknown, counted as dropped)
+ * @param[in] event_id  Event ID ('e': Entry / 'r': Return)
+ */
+static void klfer_fanout(struct klfer_probe *probe, struct klfer_ri_data *data, char event_id)
+{
+    struct klfer_probe_subs *subs;
+    struct klfer_session *sess;
+    struct klfer_event ev;
+    u64 now = ktime_get_ns(), threshold, duration = 0, overhead;
+    u32 stack_id = 0;
+    bool b_stack = false;
+    unsigned int rate;
+    int sess_idx, func_idx, state;
+
+    if(event_id == 'e')
+    {
+        data->entry_time = now;
+        data->stack_sessions = 0;
+    }
+    else if(data->entry_time)
+    {
+        duration = now - data->entry_time;
     }
-    for(func_idx=0; func_idx<modData.num_of_funcs; func_idx++)
+    ev.pid = current->pid;
+
+    rcu_read_lock();
+    subs = rcu_dereference(probe->subs);
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
     {
-        if(strcmp(func_name, modData.funcs[func_idx].func_name) == 0)
+        func_idx = READ_ONCE(subs->sess_func_idx[sess_idx]);
+        if(func_idx == NO_FUNC_IDX) continue;
+        sess = &modData.sessions[sess_idx];
+        if(READ_ONCE(sess->disarmed) & (1U << func_idx)) continue;
+        state = atomic_read(&sess->state);
+        if(!(state & SESS_F_LOGGING)) continue;
+        if(event_id == 'r' && !data->entry_time)
+        {
+            /* duration is unknown, so the call must not skew the counters */
+            klfer_count_drop(sess, func_idx);
+            continue;
+        }
+        threshold = sess->funcs[func_idx].threshold_ns;
+        ev.func_idx = func_idx;
+        ev.event_id = event_id;
+        ev.stack_id = 0;
+        ev.duration = duration;
+        if(event_id == 'r' && (state & SESS_F_SUBTRACT))
+        {
+            /* cost of the handlers measured by klfer_calibrate() */
+            overhead = this_cpu_read(sess->bufs->overhead_ns);
+            ev.duration = (duration > overhead) ? duration - overhead : 0;
+        }
+        if(event_id == 'e')
         {
-            if(!modData.funcs[func_idx].b_registered)
+            rate = probe->b_user ? 0 : READ_ONCE(sess->stack_rate);
+            if(rate && this_cpu_inc_return(sess->bufs->stack_seq) % rate == 0)
             {
-                pr_err("Err: Not registered - %s\n", func_name);
-                return KLFER_ERR;
+                data->stack_sessions |= 1 << sess_idx;
             }
         }
-        if(modData.funcs[func_idx].b_registered &&
-           strcmp(func_name, modData.funcs[func_idx].func_name) == 0)
+        else
         {
-            break;
+            klfer_count(sess, func_idx, ev.duration);
+            if((data->stack_sessions & (1 << sess_idx)) && ev.duration >= threshold)
+            {
+                /* stored once and shared by sessions */
+                if(!b_stack)
+                {
+                    stack_id = klfer_stack_intern(data->entries, data->nr_entries);
+                    b_stack = true;
+                }
+                ev.stack_id = stack_id;
+            }
+        }
+        if(state & SESS_F_PAIRED)
+        {
+            if(event_id == 'e' || ev.duration < threshold) continue;
+            ev.event_id = 'p';
         }
+        ev.time = (state & SESS_F_TIMESTAMP) ? now : 0;
+        klfer_log(sess, &ev, state);
     }
-    if(func_idx >= modData.num_of_funcs)
+    rcu_read_unlock();
+
+    if(data->stack_sessions && event_id == 'e')
     {
-        pr_err("Err: No entry - %s\n", func_name);
-        return KLFER_ERR;
+        klfer_save_stack(probe, data);
     }
+}
+
+/**
+ * Save stack at entry of the probed function to kretprobe instance
+ * Frames of kprobes and KLFER are dropped, so the stack begins with the probed function.
+ * @param[in] *probe Probe
+ * @param[out] *data Per-call data of kretprobe instance
+ */
+static void klfer_save_stack(struct klfer_probe *probe, struct klfer_ri_data *data)
+{
+    unsigned long addr = (unsigned long)probe->krp.kp.addr;
+    unsigned int nr, skip;
 
-    if(modData.b_timestamp)
+    nr = stack_trace_save(data->entries, KLFER_STACK_DEPTH + STACK_SKIP_MAX, 0);
+    for(skip=0; skip<nr && skip<STACK_SKIP_MAX; skip++)
     {
-        getnstimeofday(&modData.logs[modData.num_of_logs].time);
+        /* address of breakpoint (or the next instruction) */
+        if(data->entries[skip] - addr < STACK_PROBE_SLACK) break;
     }
-    modData.logs[modData.num_of_logs].func_idx = func_idx;
-    modData.logs[modData.num_of_logs].event_id = event_id;
+    if(skip == nr || skip == STACK_SKIP_MAX) skip = 0;
+    nr = min(nr - skip, (unsigned int)KLFER_STACK_DEPTH);
+    memmove(data->entries, data->entries + skip, sizeof(data->entries[0]) * nr);
+    data->nr_entries = nr;
+}
+
+/**
+ * Logger function
+ * Called under rcu_read_lock(). Each CPU writes its own log stream with IRQs
+ * disabled, and publishes the record by advancing the committed head.
+ * @param[in] *sess    Session
+ * @param[in,out] *ev  Event (cpu is set)
+ * @param[in] state    Snapshot of session state flags
+ * @retval KLFER_OK  Success
+ * @retval KLFER_Err Error (No log space or quota)
+ */
+static int klfer_log(struct klfer_session *sess, struct klfer_event *ev, int state)
+{
+    struct klfer_cpu_buf *buf;
+    unsigned long flags;
+    u64 prev_time, first_time;
+    int ret;
 
-    if(modData.b_jit_log)
+    local_irq_save(flags);
+    buf = this_cpu_ptr(sess->bufs);
+    ev->cpu = smp_processor_id();
+    prev_time = (buf->head ? buf->last_time : ev->time);
+    ret = klfer_put_log(buf, ev, state, klfer_log_limit(sess, buf, ev->func_idx));
+    if(ret < 0)
+        buf->stats[ev->func_idx].dropped++;
+    else
+        buf->used[ev->func_idx] += ret;
+    first_time = buf->first_time;
+    local_irq_restore(flags);
+    if(ret < 0)
     {
-        klfer_print_log(modData.num_of_logs);
+        return KLFER_ERR;
     }
 
-    modData.num_of_logs++;
+    if(state & SESS_F_JIT_LOG)
+    {
+        klfer_print_event(sess, atomic_inc_return(&sess->jit_seq), ev,
+                          klfer_event_time(sess, state, ev, first_time, prev_time), state);
+    }
     return KLFER_OK;
 }
 
 /**
- * Dump logs
- * @param[in] start_idx Start index of the log to print
- * @param[in] num       Number of logs to print
+ * End of the log stream a function can write to
+ * A function with quota writes only to its share of the stream. The shares not
+ * used yet are reserved, so functions without quota write only to the rest.
+ * @param[in] *sess    Session
+ * @param[in] *buf     Log stream of current CPU
+ * @param[in] func_idx Index of the function to be logged
+ * @return Offset in the stream which records must not exceed
  */
-static void klfer_dump_logs(int start_idx, int num)
+static size_t klfer_log_limit(struct klfer_session *sess, struct klfer_cpu_buf *buf, int func_idx)
 {
-    int i;
+    u32 mask = READ_ONCE(sess->quota_mask);
+    size_t quota, reserved = 0;
+    int idx;
+
+    if(mask & (1U << func_idx))
+    {
+        quota = buf->size / 100 * READ_ONCE(sess->funcs[func_idx].quota_pct);
+        if(buf->used[func_idx] >= quota) return buf->head;
+        return min(buf->head + quota - buf->used[func_idx], buf->size);
+    }
+    while(mask)
+    {
+        idx = __ffs(mask);
+        mask &= mask - 1;
+        quota = buf->size / 100 * READ_ONCE(sess->funcs[idx].quota_pct);
+        if(buf->used[idx] < quota) reserved += quota - buf->used[idx];
+    }
+    return (reserved < buf->size) ? buf->size - reserved : 0;
+}
+
+/**
+ * Write a record to the log stream of current CPU
+ * @param[in] *buf   Log stream of current CPU
+ * @param[in] *ev    Event to be written
+ * @param[in] state  Snapshot of session state flags
+ * @param[in] limit  Offset which the record must not exceed (see klfer_log_limit())
+ * @retval >=0       Bytes written
+ * @retval KLFER_ERR No log space
+ */
+static int klfer_put_log(struct klfer_cpu_buf *buf, struct klfer_event *ev, int state, size_t limit)
+{
+    struct klfer_log *log;
+    size_t head = buf->head, pos = head;
+    u64 time = ev->time, delta, duration;
+    int len, sync_len;
+
+    if(state & SESS_F_COMPACT)
+    {
+        /* record without timestamp restarts the stream time at 0 by SYNC (decoded as 0 like FIXED format) */
+        sync_len = (time == 0 && buf->last_time != 0) ? KLFER_SYNC_LEN : 0;
+        /* deltas must not be negative (an interrupt may log between reading the clock and here) */
+        if(time && time < buf->last_time) time = buf->last_time;
+        delta = sync_len ? 0 : time - buf->last_time;
+        len = klfer_compact_len(ev, delta);
+        if(pos % KLFER_BLOCK_SIZE == 0 || pos % KLFER_BLOCK_SIZE + sync_len + len > KLFER_BLOCK_SIZE)
+        {
+            /* start new block with SYNC record */
+            pos = round_up(pos, KLFER_BLOCK_SIZE);
+            delta = 0;
+            len = klfer_compact_len(ev, delta);
+            if(pos + KLFER_SYNC_LEN + len > limit) goto NO_SPACE;
+            memset(buf->data + head, KLFER_TAG_PAD, pos - head);
+            pos += klfer_put_sync(buf->data + pos, time);
+        }
+        else
+        {
+            if(pos + sync_len + len > limit) goto NO_SPACE;
+            if(sync_len) pos += klfer_put_sync(buf->data + pos, time);
+        }
+        pos += klfer_put_compact(buf->data + pos, ev, delta);
+    }
+    else
+    {
+        if(pos + sizeof(*log) > limit) goto NO_SPACE;
+        log = (struct klfer_log *)(buf->data + pos);
+        /* the whole record is copied to the application */
+        memset(log, 0, sizeof(*log));
+        log->time = time;
+        duration = min_t(u64, ev->duration, KLFER_LOG_DURATION_MAX);
+        log->duration_hi = (u16)(duration >> 32);
+        log->duration_lo = (u32)duration;
+        log->pid = ev->pid;
+        log->func_idx = ev->func_idx;
+        log->event_id = ev->event_id;
+        log->stack_id = ev->stack_id;
+        pos += sizeof(*log);
+    }
+
+    if(head == 0) buf->first_time = time;
+    buf->last_time = time;
+    smp_store_release(&buf->head, pos);
+    return pos - head;
+NO_SPACE:
+    buf->dropped++;
+    return KLFER_ERR;
+}
+
+/**
+ * Count a returned call in the counters of current CPU
+ * @param[in] *sess    Session
+ * @param[in] func_idx Index of returned function in the session
+ * @param[in] duration Nanoseconds from entry to return
+ */
+static void klfer_count(struct klfer_session *sess, int func_idx, u64 duration)
+{
+    struct klfer_func_stat *stat;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    stat = &this_cpu_ptr(sess->bufs)->stats[func_idx];
+    stat->calls++;
+    stat->total_ns += duration;
+    if(duration > stat->max_ns) stat->max_ns = duration;
+    stat->hist[min(duration > 1 ? fls64(duration - 1) : 0, KLFER_HIST_BUCKETS - 1)]++;
+    local_irq_restore(flags);
+}
+
+/**
+ * Count a dropped log in the counters of current CPU
+ * @param[in] *sess    Session
+ * @param[in] func_idx Index of function in the session
+ */
+static void klfer_count_drop(struct klfer_session *sess, int func_idx)
+{
+    unsigned long flags;
 
-    if(start_idx >= modData.num_of_logs) return;
-    if((start_idx + num) > modData.num_of_logs) num = (modData.num_of_logs - start_idx);
-    for(i=start_idx; i<start_idx+num; i++)
+    local_irq_save(flags);
+    this_cpu_ptr(sess->bufs)->stats[func_idx].dropped++;
+    local_irq_restore(flags);
+}
+
+/**
+ * Dump number of dropped logs of each function
+ * @param[in] *sess Session
+ */
+static void klfer_dump_drops(struct klfer_session *sess)
+{
+    u64 dropped;
+    int func_idx, cpu;
+
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+    {
+        dropped = 0;
+        for_each_possible_cpu(cpu)
+        {
+            dropped += per_cpu_ptr(sess->bufs, cpu)->stats[func_idx].dropped;
+        }
+        if(dropped)
+        {
+            printk("  %s : %llu logs dropped%s\n", sess->funcs[func_idx].func_name, dropped,
+                   ((sess->quota_mask & (1U << func_idx)) ? " (quota)" : ""));
+        }
+    }
+}
+
+/**
+ * Dump logs of all CPUs in time order
+ * @param[in] *sess Session
+ */
+static void klfer_dump_logs(struct klfer_session *sess)
+{
+    struct klfer_cursor *curs;
+    struct klfer_event *evs;
+    struct klfer_cpu_buf *buf;
+    int *rets;
+    int cpu, min_cpu, seq = 0, state;
+    u64 first_time = 0, prev_time = 0;
+    unsigned long dropped = 0;
+
+    curs = kmalloc_array(nr_cpu_ids, sizeof(*curs), GFP_KERNEL);
+    evs  = kmalloc_array(nr_cpu_ids, sizeof(*evs), GFP_KERNEL);
+    rets = kmalloc_array(nr_cpu_ids, sizeof(*rets), GFP_KERNEL);
+    if(!curs || !evs || !rets) goto EXIT;
+
+    state = atomic_read(&sess->state);
+    for(cpu=0; cpu<nr_cpu_ids; cpu++)
+    {
+        rets[cpu] = 0;
+        if(!cpu_possible(cpu)) continue;
+        buf = per_cpu_ptr(sess->bufs, cpu);
+        klfer_cursor_init(&curs[cpu], buf->data, smp_load_acquire(&buf->head), 0,
+                          (state & SESS_F_COMPACT) ? KLFER_FMT_COMPACT : KLFER_FMT_FIXED, cpu);
+        rets[cpu] = klfer_next_event(&curs[cpu], &evs[cpu]);
+        dropped += buf->dropped;
+    }
+    while(true)
+    {
+        /* pick the oldest event among CPUs */
+        min_cpu = -1;
+        for(cpu=0; cpu<nr_cpu_ids; cpu++)
+        {
+            if(rets[cpu] < 0)
+            {
+                pr_err("Err: broken log on cpu%d (offset %llu)\n", cpu, curs[cpu].pos);
+                rets[cpu] = 0;
+            }
+            if(rets[cpu] > 0 && (min_cpu < 0 || evs[cpu].time < evs[min_cpu].time))
+            {
+                min_cpu = cpu;
+            }
+        }
+        if(min_cpu < 0) break;
+        if(seq == 0) first_time = prev_time = evs[min_cpu].time;
+        klfer_print_event(sess, ++seq, &evs[min_cpu],
+                          klfer_event_time(sess, state, &evs[min_cpu], first_time, prev_time), state);
+        prev_time = evs[min_cpu].time;
+        rets[min_cpu] = klfer_next_event(&curs[min_cpu], &evs[min_cpu]);
+    }
+    if(dropped)
     {
-        klfer_print_log(i);
+        printk("Err: No log space - %lu logs dropped (%s)\n", dropped, sess->name);
+        klfer_dump_drops(sess);
     }
+EXIT:
+    kfree(rets);
+    kfree(evs);
+    kfree(curs);
 }
 
 /**
  * Register function
- * @param[in] *cfg Configurations for registration
+ * @param[in] *sess Session
+ * @param[in] *cfg  Configurations for registration
  * @retval  KLFER_OK Success
  * @retval -EALREADY Same function is already registered
  * @retval -ENOBUFS  Maximum number of registrations has been reached
+ * @retval -EINVAL   Total quota of the session exceeds 100%
+ * @retval -ENOENT   Symbol without "<module>:" is not found
+ * @retval <0        Other errors (e.g. binary of user function is not found)
  */
-static int klfer_register_func(struct klfer_func_cfg *cfg)
+static int klfer_register_func(struct klfer_session *sess, struct klfer_func_cfg *cfg)
 {
-    int func_idx, ret;
+    struct klfer_probe *probe;
+    unsigned int quota = cfg->quota_pct;
+    const char *sep;
+    int func_idx, idx, ret;
 
     /* search same function */
-    for(func_idx=0; func_idx<modData.num_of_funcs; func_idx++)
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
     {
-        if(strcmp(modData.funcs[func_idx].func_name, cfg->func_name) == 0)
+        if(strcmp(sess->funcs[func_idx].func_name, cfg->func_name) == 0)
         {
-            if(modData.funcs[func_idx].b_registered == true)
+            if(sess->funcs[func_idx].b_registered || sess->funcs[func_idx].b_pending)
             {
                 pr_err("%s is already registered.\n", cfg->func_name);
                 return -EALREADY;
             }
+            break;
         }
     }
     if(func_idx == MAX_REG_FUNCS)
@@ -186,244 +897,1242 @@ static int klfer_register_func(struct klfer_func_cfg *cfg)
         pr_err("Too many funcs registered.\n");
         return -ENOBUFS;
     }
-    if(func_idx == modData.num_of_funcs)
+    for(idx=0; idx<sess->num_of_funcs; idx++)
+    {
+        if(sess->quota_mask & (1U << idx)) quota += sess->funcs[idx].quota_pct;
+    }
+    if(quota > 100)
+    {
+        pr_err("Total quota of %s exceeds 100%%.\n", sess->name);
+        return -EINVAL;
+    }
+    if(func_idx == sess->num_of_funcs)
     {
         /* new function */
-        strcpy(modData.funcs[func_idx].func_name, cfg->func_name);
-        modData.num_of_funcs++;
-    }
-    modData.funcs[func_idx].b_registered = true;
-    /* register kretprobe */
-    modData.funcs[func_idx].krp.kp.symbol_name = modData.funcs[func_idx].func_name;
-    modData.funcs[func_idx].krp.handler = klfer_ret_handler;
-    modData.funcs[func_idx].krp.entry_handler = klfer_entry_handler;
-    modData.funcs[func_idx].krp.maxactive = 20;
-    ret = register_kretprobe(&modData.funcs[func_idx].krp);
-    if(ret < 0)
+        strcpy(sess->funcs[func_idx].func_name, cfg->func_name);
+    }
+    /* handlers read threshold after the subscription is published */
+    sess->funcs[func_idx].threshold_ns = cfg->threshold_ns;
+    WRITE_ONCE(sess->funcs[func_idx].quota_pct, cfg->quota_pct);
+    /* function is armed when registered */
+    WRITE_ONCE(sess->disarmed, sess->disarmed & ~(1U << func_idx));
+    if(cfg->path[0] != '\0')
+    {
+        /* user function (binary must exist, never pending) */
+        probe = klfer_get_uprobe(cfg);
+        ret = IS_ERR(probe) ? PTR_ERR(probe) : klfer_attach_probe(sess, func_idx, probe);
+    }
+    else
+    {
+        ret = klfer_arm_func(sess, func_idx);
+    }
+    sep = strchr(cfg->func_name, ':');
+    if(ret == -ENOENT && cfg->path[0] == '\0' && sep && sep - cfg->func_name < MODULE_NAME_LEN)
+    {
+        /* "<module>:<func>" is armed when the module is loaded (see klfer_module_notify()) */
+        strlcpy(sess->funcs[func_idx].pending_mod, cfg->func_name, sep - cfg->func_name + 1);
+        pr_info("%s is pending until its module is loaded.\n", cfg->func_name);
+        sess->funcs[func_idx].b_pending = true;
+        ret = KLFER_REG_PENDING;
+    }
+    if(ret >= 0 && cfg->quota_pct)
+    {
+        /* share is reserved while the function is registered (or pending) */
+        WRITE_ONCE(sess->quota_mask, sess->quota_mask | (1U << func_idx));
+    }
+    if(ret >= 0 && func_idx == sess->num_of_funcs)
+    {
+        sess->num_of_funcs++;
+    }
+    return ret;
+}
+
+/**
+ * Register kretprobe for the function of the session
+ * @param[in] *sess    Session
+ * @param[in] func_idx Index of function (func_name is set)
+ * @retval  KLFER_OK Success
+ * @retval -ENOENT   Symbol is not found
+ * @retval <0        Other errors of klfer_get_probe() / klfer_update_subs()
+ */
+static int klfer_arm_func(struct klfer_session *sess, int func_idx)
+{
+    struct klfer_probe *probe;
+
+    /* register (or share) kretprobe */
+    probe = klfer_get_probe(sess->funcs[func_idx].func_name);
+    if(IS_ERR(probe))
+    {
+        return PTR_ERR(probe);
+    }
+    return klfer_attach_probe(sess, func_idx, probe);
+}
+
+/**
+ * Subscribe the function of the session to the probe
+ * @param[in] *sess    Session
+ * @param[in] func_idx Index of function
+ * @param[in] *probe   Probe got for the function (put on error)
+ * @retval  KLFER_OK Success
+ * @retval <0        Error of klfer_update_subs()
+ */
+static int klfer_attach_probe(struct klfer_session *sess, int func_idx, struct klfer_probe *probe)
+{
+    int ret;
+
+    sess->funcs[func_idx].probe = probe;
+    sess->funcs[func_idx].b_registered = true;
+    sess->funcs[func_idx].b_pending = false;
+    /* handlers start logging for this session from here */
+    ret = klfer_update_subs(probe, SESSION_IDX(sess), func_idx);
+    if(ret)
+    {
+        sess->funcs[func_idx].b_registered = false;
+        sess->funcs[func_idx].probe = NULL;
+        klfer_put_probe(probe);
+        return ret;
+    }
+    /* shared kretprobe may have been disabled by other sessions */
+    klfer_sync_probe(probe);
+    return KLFER_OK;
+}
+
+/**
+ * Enable kretprobe if any subscribing session logs the function, disable it otherwise
+ * A disabled kretprobe stays registered, so it is enabled again without registration.
+ * uprobes are not disabled (disarmed user functions are skipped by the handlers).
+ * @param[in] *probe Probe
+ */
+static void klfer_sync_probe(struct klfer_probe *probe)
+{
+    struct klfer_probe_subs *subs;
+    bool b_used = false;
+    int sess_idx, func_idx;
+
+    if(probe->b_user) return;
+    subs = rcu_dereference_protected(probe->subs, lockdep_is_held(&modData.ctrl_lock));
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
+    {
+        func_idx = subs->sess_func_idx[sess_idx];
+        if(func_idx == NO_FUNC_IDX) continue;
+        if(!(modData.sessions[sess_idx].disarmed & (1U << func_idx)))
+        {
+            b_used = true;
+            break;
+        }
+    }
+    if(b_used != probe->b_disabled) return;
+    if(b_used ? enable_kretprobe(&probe->krp) : disable_kretprobe(&probe->krp))
+    {
+        pr_err("Err: failed to %s kretprobe of %s\n", b_used ? "enable" : "disable", probe->func_name);
+        return;
+    }
+    probe->b_disabled = !b_used;
+}
+
+/**
+ * Arm / disarm registered functions at once
+ * Handlers skip disarmed functions, and kretprobes which no session logs are
+ * disabled, so functions are switched without unregistering the probes.
+ * @param[in] *sess Session
+ * @param[in] *cfg  Functions to be armed / disarmed
+ * @retval KLFER_OK Success
+ * @retval -EINVAL  A mask has a bit of no function
+ */
+static int klfer_arm_funcs(struct klfer_session *sess, struct klfer_arm_cfg *cfg)
+{
+    u32 valid = (1U << sess->num_of_funcs) - 1;
+    u32 changed = cfg->arm_mask | cfg->disarm_mask;
+    int func_idx;
+
+    if(changed & ~valid)
+    {
+        return -EINVAL;
+    }
+    WRITE_ONCE(sess->disarmed, (sess->disarmed | cfg->disarm_mask) & ~cfg->arm_mask);
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+    {
+        if((changed & (1U << func_idx)) && sess->funcs[func_idx].b_registered)
+        {
+            klfer_sync_probe(sess->funcs[func_idx].probe);
+        }
+    }
+    return KLFER_OK;
+}
+
+/**
+ * Unregister function
+ * @param[in] *sess Session
+ * @param[in] *cfg  Configurations for registration
+ * @retval  KLFER_OK Success
+ * @retval -ESRCH    The function is not registered yet
+ */
+static int klfer_unregister_func(struct klfer_session *sess, struct klfer_func_cfg *cfg)
+{
+    int func_idx;
+
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+    {
+        if(strcmp(cfg->func_name, sess->funcs[func_idx].func_name) != 0) continue;
+        if(sess->funcs[func_idx].b_registered || sess->funcs[func_idx].b_pending)
+        {
+            WRITE_ONCE(sess->quota_mask, sess->quota_mask & ~(1U << func_idx));
+        }
+        if(sess->funcs[func_idx].b_registered)
+        {
+            klfer_unregister_kretprobe(sess, func_idx);
+            /* probe shared with other sessions stays registered, so wait for handlers which still see the old subscription */
+            synchronize_rcu();
+            return KLFER_OK;
+        }
+        if(sess->funcs[func_idx].b_pending)
+        {
+            sess->funcs[func_idx].b_pending = false;
+            return KLFER_OK;
+        }
+    }
+    pr_err("Err: %s() is not registered.\n", cfg->func_name);
+    return -ESRCH;
+}
+
+/**
+ * Unregister all registered functions
+ * @param[in] *sess Session
+ */
+static void klfer_reset_funcs(struct klfer_session *sess)
+{
+    int func_idx, cpu;
+
+    for(func_idx=0; func_idx<MAX_REG_FUNCS; func_idx++)
+    {
+        if(sess->funcs[func_idx].b_registered)
+        {
+            klfer_unregister_kretprobe(sess, func_idx);
+        }
+        sess->funcs[func_idx].b_pending = false;
+    }
+    /* wait for handlers which still see the old subscriptions */
+    synchronize_rcu();
+    sess->num_of_funcs = 0;
+    sess->generation = ++modData.generation;
+    sess->disarmed = 0;
+    sess->quota_mask = 0;
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(sess->bufs, cpu)->stats, 0, sizeof(struct klfer_func_stat) * MAX_REG_FUNCS);
+    }
+}
+
+/**
+ * Delete all logs
+ * Called after klfer_reset_funcs() or klfer_quiesce(), so no handler writes to the logs.
+ * @param[in] *sess Session
+ */
+static void klfer_reset_logs(struct klfer_session *sess)
+{
+    struct klfer_cpu_buf *buf;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        buf = per_cpu_ptr(sess->bufs, cpu);
+        buf->head = 0;
+        buf->last_time = 0;
+        buf->first_time = 0;
+        buf->dropped = 0;
+        memset(buf->used, 0, sizeof(buf->used));
+    }
+    atomic_set(&sess->jit_seq, 0);
+    sess->time_offset = ktime_get_real_ns() - ktime_get_ns();
+}
+
+/**
+ * Stop logging of the session and wait for running handlers
+ * @param[in] *sess Session
+ * @return Session state flags before stop
+ */
+static int klfer_quiesce(struct klfer_session *sess)
+{
+    int state = atomic_read(&sess->state);
+
+    atomic_set(&sess->state, state & ~SESS_F_LOGGING);
+    /* handlers read state under rcu_read_lock() */
+    synchronize_rcu();
+    return state;
+}
+
+/**
+ * Set control parameters
+ * @param[in] *sess      Session
+ * @param[in] ctrl_param Control parameters
+ * @retval KLFER_OK  Success
+ * @retval KLFER_ERR Error
+ */
+static int klfer_set_params(struct klfer_session *sess, int ctrl_param)
+{
+    /* Handlers read all settings at once, so build new state and publish it in one store */
+    int state = atomic_read(&sess->state);
+
+    /* Logger control */
+    if(ctrl_param & (UPDATE_FLAG << LOGGER_CTRL_SHIFT))
+    {
+        if(ctrl_param & (VALUE_BIT << LOGGER_CTRL_SHIFT))
+            state |= SESS_F_LOGGING;
+        else
+            state &= ~SESS_F_LOGGING;
+    }
+    /* JIT print log control */
+    if(ctrl_param & (UPDATE_FLAG << JIT_CTRL_SHIFT))
+    {
+        if(ctrl_param & (VALUE_BIT << JIT_CTRL_SHIFT))
+            state |= SESS_F_JIT_LOG;
+        else
+            state &= ~SESS_F_JIT_LOG;
+    }
+    /* Timestamp control */
+    if(ctrl_param & (UPDATE_FLAG << TIMESTAMP_CTRL_SHIFT))
+    {
+        /* Enable / Disable */
+        if(ctrl_param & (VALUE_BIT << TIMESTAMP_CTRL_SHIFT))
+            state |= SESS_F_TIMESTAMP;
+        else
+            state &= ~SESS_F_TIMESTAMP;
+
+        /* Format */
+        state &= ~(0b11 << SESS_TS_FMT_SHIFT);
+        state |= TS_FMT_MASK(ctrl_param) << SESS_TS_FMT_SHIFT;
+    }
+    /* Paired-call record control */
+    if(ctrl_param & (UPDATE_FLAG << PAIRED_CTRL_SHIFT))
+    {
+        if(ctrl_param & (VALUE_BIT << PAIRED_CTRL_SHIFT))
+            state |= SESS_F_PAIRED;
+        else
+            state &= ~SESS_F_PAIRED;
+    }
+    /* Overhead subtraction control */
+    if(ctrl_param & (UPDATE_FLAG << SUBTRACT_CTRL_SHIFT))
+    {
+        if(ctrl_param & (VALUE_BIT << SUBTRACT_CTRL_SHIFT))
+            state |= SESS_F_SUBTRACT;
+        else
+            state &= ~SESS_F_SUBTRACT;
+    }
+    /* Compact log format control */
+    if(ctrl_param & (UPDATE_FLAG << COMPACT_CTRL_SHIFT))
+    {
+        if(ctrl_param & (VALUE_BIT << COMPACT_CTRL_SHIFT))
+            state |= SESS_F_COMPACT;
+        else
+            state &= ~SESS_F_COMPACT;
+    }
+    if((state ^ atomic_read(&sess->state)) & SESS_F_COMPACT)
+    {
+        /* a log stream holds only one format */
+        klfer_quiesce(sess);
+        klfer_reset_logs(sess);
+    }
+    atomic_set(&sess->state, state);
+    return KLFER_OK;
+}
+
+/**
+ * Dump current settings and registered functions
+ * @param[in] *sess Session
+ */
+static void klfer_dump_settings(struct klfer_session *sess)
+{
+    unsigned int num_stacks, max_stacks, overflow;
+    u64 overhead, ovh_min = U64_MAX, ovh_max = 0, ovh_sum = 0, dropped;
+    int func_idx, cpu, num_cpus = 0;
+    char ts_fmt[40], quota[8];
+    int state = atomic_read(&sess->state);
+
+    switch(SESS_TS_FMT(state))
+    {
+    case TS_FMT_ABS:
+        strcpy(ts_fmt, "Absolute time");
+        break;
+    case TS_FMT_RLTV_FIRST:
+        strcpy(ts_fmt, "Relative time from the first log");
+        break;
+    case TS_FMT_RLTV_PREV:
+        strcpy(ts_fmt, "Relative time from the previous log");
+        break;
+    default:
+        strcpy(ts_fmt, "Unknown format");
+        break;
+    }
+
+    /* Dump parameter settings */
+    printk("Session       : %s\n", sess->name);
+    printk("Logger        : %s\n", ((state & SESS_F_LOGGING) ?   "Enable" : "Disable"));
+    printk("JIT print log : %s\n", ((state & SESS_F_JIT_LOG) ?   "Enable" : "Disable"));
+    printk("Timestamp     : %s\n", ((state & SESS_F_TIMESTAMP) ? "Enable" : "Disable"));
+    printk("Timestamp fmt : %s\n", ts_fmt);
+    printk("Paired call   : %s\n", ((state & SESS_F_PAIRED) ?   "Enable" : "Disable"));
+    printk("Log format    : %s\n", ((state & SESS_F_COMPACT) ?  "Compact" : "Fixed"));
+    printk("Log buffer    : %zu bytes x %d CPUs\n", sess->buf_size, num_possible_cpus());
+    if(sess->stack_rate)
+        printk("Stack capture : 1 of %u calls\n", sess->stack_rate);
+    else
+        printk("Stack capture : Disable\n");
+    klfer_stack_usage(&num_stacks, &max_stacks, &overflow);
+    printk("Stack table   : %u / %u stacks (%u not saved)\n", num_stacks, max_stacks, overflow);
+    for_each_possible_cpu(cpu)
+    {
+        overhead = per_cpu_ptr(sess->bufs, cpu)->overhead_ns;
+        if(!overhead) continue;
+        ovh_min = min(ovh_min, overhead);
+        ovh_max = max(ovh_max, overhead);
+        ovh_sum += overhead;
+        num_cpus++;
+    }
+    if(num_cpus)
+        printk("Overhead      : %llu nsec (min %llu / max %llu), %s\n", div_u64(ovh_sum, num_cpus),
+               ovh_min, ovh_max, ((state & SESS_F_SUBTRACT) ? "Subtracted" : "Not subtracted"));
+    else
+        printk("Overhead      : Not measured\n");
+
+    /* Dump registered functions */
+    printk("[Indx] [Reg] [Threshold(nsec)] [Quota] [  Dropped ] function_name\n");
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+    {
+        dropped = 0;
+        for_each_possible_cpu(cpu)
+        {
+            dropped += per_cpu_ptr(sess->bufs, cpu)->stats[func_idx].dropped;
+        }
+        if(sess->quota_mask & (1U << func_idx))
+            snprintf(quota, sizeof(quota), "%4u%%", sess->funcs[func_idx].quota_pct);
+        else
+            strcpy(quota, "  -  ");
+        printk("[%4d] [ %c ] [%15llu] [%s] [%10llu] %s\n", func_idx,
+                (sess->funcs[func_idx].b_registered ? ((sess->disarmed & (1U << func_idx)) ? 'D' : 'Y') :
+                 (sess->funcs[func_idx].b_pending ? 'P' : 'N')),
+                sess->funcs[func_idx].threshold_ns, quota, dropped,
+                sess->funcs[func_idx].func_name);
+    }
+}
+
+/**
+ * Timestamp of event to be printed
+ * @param[in] *sess      Session
+ * @param[in] state      Session state flags
+ * @param[in] *ev        Event (return time is printed for paired-call record)
+ * @param[in] first_time Timestamp of the first event
+ * @param[in] prev_time  Timestamp of the previous event
+ * @return Timestamp in the format of session (nsec)
+ */
+static s64 klfer_event_time(struct klfer_session *sess, int state, struct klfer_event *ev, u64 first_time, u64 prev_time)
+{
+    u64 time = ev->time;
+
+    switch(SESS_TS_FMT(state))
+    {
+    case TS_FMT_RLTV_FIRST:
+        return time - first_time;
+    case TS_FMT_RLTV_PREV:
+        return time - prev_time;
+    default:
+        return time + sess->time_offset;
+    }
+}
+
+/**
+ * Print event log
+ * @param[in] *sess     Session
+ * @param[in] seq       Sequence number (1 origin)
+ * @param[in] *ev       Event
+ * @param[in] timestamp Timestamp to be printed (nsec)
+ * @param[in] state     Session state flags
+ */
+static void klfer_print_event(struct klfer_session *sess, int seq, struct klfer_event *ev, s64 timestamp, int state)
+{
+    struct klfer_stack_cfg stack;
+    char buf[MAX_STR_LEN * 3];
+    int offset = 0, i;
+
+    if(state & SESS_F_TIMESTAMP)
+    {
+        offset = snprintf(buf, 32, "[ %20lld nsec] ", timestamp);
+    }
+    offset += snprintf(buf + offset, MAX_STR_LEN * 3 - offset, "[%d] %c %s",
+                       seq,
+                       ev->event_id,
+                       (ev->func_idx < MAX_REG_FUNCS ? sess->funcs[ev->func_idx].func_name : "?"));
+    if(ev->event_id == 'p' && offset < MAX_STR_LEN * 3)
+    {
+        snprintf(buf + offset, MAX_STR_LEN * 3 - offset, " %llu nsec (pid %u, cpu %u)",
+                 ev->duration, ev->pid, ev->cpu);
+    }
+    printk("%s\n", buf);
+    stack.stack_id = ev->stack_id;
+    if(ev->stack_id && klfer_stack_get(&stack) == KLFER_OK)
+    {
+        for(i=0; i<stack.nr_entries; i++)
+        {
+            printk("    %pS\n", (void *)(unsigned long)stack.entries[i]);
+        }
+    }
+}
+
+/**
+ * Convert session state flags to control parameters for the application
+ * @param[in] state Session state flags
+ * @return Control parameters (UPDATE_FLAG is 0)
+ */
+static u32 klfer_info_state(int state)
+{
+    u32 ret = 0;
+
+    if(state & SESS_F_LOGGING)   ret |= VALUE_BIT << LOGGER_CTRL_SHIFT;
+    if(state & SESS_F_JIT_LOG)   ret |= VALUE_BIT << JIT_CTRL_SHIFT;
+    if(state & SESS_F_TIMESTAMP) ret |= VALUE_BIT << TIMESTAMP_CTRL_SHIFT;
+    if(state & SESS_F_COMPACT)   ret |= VALUE_BIT << COMPACT_CTRL_SHIFT;
+    if(state & SESS_F_PAIRED)    ret |= VALUE_BIT << PAIRED_CTRL_SHIFT;
+    if(state & SESS_F_SUBTRACT)  ret |= VALUE_BIT << SUBTRACT_CTRL_SHIFT;
+    ret |= SESS_TS_FMT(state) << TIMESTAMP_FMT_SHIFT;
+    return ret;
+}
+
+/**
+ * Get session information for the application
+ * @param[in] *sess  Session
+ * @param[out] *info Information
+ */
+static void klfer_get_info(struct klfer_session *sess, struct klfer_info *info)
+{
+    int state = atomic_read(&sess->state);
+    int func_idx;
+
+    memset(info, 0, sizeof(*info));
+    info->state = klfer_info_state(state);
+    info->stack_rate = sess->stack_rate;
+    info->disarmed = sess->disarmed;
+    info->num_cpus = nr_cpu_ids;
+    info->num_of_funcs = sess->num_of_funcs;
+    info->log_fmt = (state & SESS_F_COMPACT) ? KLFER_FMT_COMPACT : KLFER_FMT_FIXED;
+    info->buf_size = sess->buf_size;
+    info->time_offset = sess->time_offset;
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+    {
+        strcpy(info->func_names[func_idx], sess->funcs[func_idx].func_name);
+    }
+}
+
+/**
+ * Sum up per-function counters of all CPUs
+ * Counters are read without stopping the handlers, so a sum may miss calls
+ * counted at the same time (they are seen by the next read).
+ * Names are copied under ctrl_lock with the counters, so they always match.
+ * @param[in] *sess   Session
+ * @param[out] *stats Counters
+ */
+static void klfer_get_stats(struct klfer_session *sess, struct klfer_stats *stats)
+{
+    struct klfer_func_stat *stat;
+    int cpu, func_idx, i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->time = ktime_get_ns();
+    stats->generation = sess->generation;
+    stats->num_of_funcs = sess->num_of_funcs;
+    stats->state = klfer_info_state(atomic_read(&sess->state));
+    for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+    {
+        strcpy(stats->func_names[func_idx], sess->funcs[func_idx].func_name);
+    }
+    for_each_possible_cpu(cpu)
+    {
+        stat = per_cpu_ptr(sess->bufs, cpu)->stats;
+        for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+        {
+            stats->funcs[func_idx].calls += READ_ONCE(stat[func_idx].calls);
+            stats->funcs[func_idx].total_ns += READ_ONCE(stat[func_idx].total_ns);
+            stats->funcs[func_idx].max_ns = max(stats->funcs[func_idx].max_ns, READ_ONCE(stat[func_idx].max_ns));
+            stats->funcs[func_idx].dropped += READ_ONCE(stat[func_idx].dropped);
+            for(i=0; i<KLFER_HIST_BUCKETS; i++)
+            {
+                stats->funcs[func_idx].hist[i] += READ_ONCE(stat[func_idx].hist[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Copy committed part of a log stream to the application
+ * @param[in] *sess    Session
+ * @param[in,out] *cfg Read request
+ * @retval KLFER_OK Success
+ * @retval -EINVAL  No such CPU
+ * @retval -EFAULT  Destination is unacceptable space
+ */
+static int klfer_read_logs(struct klfer_session *sess, struct klfer_read_cfg *cfg)
+{
+    struct klfer_cpu_buf *buf;
+    size_t head;
+
+    if(cfg->cpu >= nr_cpu_ids || !cpu_possible(cfg->cpu))
+    {
+        return -EINVAL;
+    }
+    buf = per_cpu_ptr(sess->bufs, cfg->cpu);
+    head = smp_load_acquire(&buf->head);
+    cfg->committed = head;
+    cfg->dropped = buf->dropped;
+    if(cfg->offset >= head)
+    {
+        cfg->len = 0;
+        return KLFER_OK;
+    }
+    cfg->len = min_t(u64, cfg->len, head - cfg->offset);
+    if(copy_to_user(u64_to_user_ptr(cfg->buf), buf->data + cfg->offset, cfg->len))
+    {
+        return -EFAULT;
+    }
+    return KLFER_OK;
+}
+
+/**
+ * Allocate log streams of all CPUs
+ * @param[in] *sess Session
+ * @param[in] size  Bytes per CPU
+ * @retval KLFER_OK Success
+ * @retval -ENOBUFS Failed to allocate
+ */
+static int klfer_alloc_bufs(struct klfer_session *sess, size_t size)
+{
+    int ret;
+
+    sess->bufs = alloc_percpu(struct klfer_cpu_buf);
+    if(!sess->bufs)
+    {
+        return -ENOBUFS;
+    }
+    ret = klfer_resize_bufs(sess, size);
+    if(ret)
+    {
+        free_percpu(sess->bufs);
+        sess->bufs = NULL;
+    }
+    return ret;
+}
+
+/**
+ * Replace log streams of all CPUs with new ones (logs are deleted)
+ * New streams are allocated before the old ones are released,
+ * so the current logs remain if allocation fails.
+ * @param[in] *sess Session
+ * @param[in] size  Bytes per CPU
+ * @retval KLFER_OK Success
+ * @retval -EINVAL  Size is 0
+ * @retval -ENOBUFS Failed to allocate
+ */
+static int klfer_resize_bufs(struct klfer_session *sess, size_t size)
+{
+    struct klfer_cpu_buf *buf;
+    u8 **datas;
+    int cpu, state, ret = -ENOBUFS;
+
+    if(size == 0)
+    {
+        return -EINVAL;
+    }
+    /* page granular, and COMPACT format needs whole blocks */
+    size = PAGE_ALIGN(round_up(size, KLFER_BLOCK_SIZE));
+    datas = kcalloc(nr_cpu_ids, sizeof(*datas), GFP_KERNEL);
+    if(!datas)
+    {
+        return -ENOBUFS;
+    }
+    for_each_possible_cpu(cpu)
+    {
+        /* NUMA local to the CPU which writes it */
+        datas[cpu] = vmalloc_node(size, cpu_to_node(cpu));
+        if(!datas[cpu])
+        {
+            pr_err("Err: failed to allocate %zu bytes for cpu%d\n", size, cpu);
+            goto EXIT;
+        }
+    }
+
+    state = klfer_quiesce(sess);
+    for_each_possible_cpu(cpu)
+    {
+        buf = per_cpu_ptr(sess->bufs, cpu);
+        swap(buf->data, datas[cpu]);
+        buf->size = size;
+    }
+    sess->buf_size = size;
+    klfer_reset_logs(sess);
+    atomic_set(&sess->state, state);
+    ret = KLFER_OK;
+EXIT:
+    /* old streams on success, new ones on failure */
+    for_each_possible_cpu(cpu)
+    {
+        vfree(datas[cpu]);
+    }
+    kfree(datas);
+    return ret;
+}
+
+/**
+ * Free log streams of all CPUs
+ * @param[in] *sess Session
+ */
+static void klfer_free_bufs(struct klfer_session *sess)
+{
+    int cpu;
+
+    if(!sess->bufs) return;
+    for_each_possible_cpu(cpu)
+    {
+        vfree(per_cpu_ptr(sess->bufs, cpu)->data);
+    }
+    free_percpu(sess->bufs);
+    sess->bufs = NULL;
+    sess->buf_size = 0;
+}
+
+/**
+ * Initialize session
+ * @param[in] *sess Session
+ * @param[in] *name Session name
+ * @retval KLFER_OK Success
+ * @retval -ENOBUFS Failed to kmalloc
+ */
+static int klfer_init_session(struct klfer_session *sess, const char *name)
+{
+    int i;
+
+    strlcpy(sess->name, name, MAX_STR_LEN);
+    sess->users = 0;
+    sess->b_private = false;
+    sess->num_of_funcs = 0;
+    sess->generation = ++modData.generation;
+    sess->stack_rate = 0;
+    sess->disarmed = 0;
+    sess->quota_mask = 0;
+    atomic_set(&sess->state, SESS_F_TIMESTAMP | (TS_FMT_ABS << SESS_TS_FMT_SHIFT));
+    for(i=0; i<MAX_REG_FUNCS; i++)
+    {
+        sess->funcs[i].b_registered = false;
+        sess->funcs[i].b_pending = false;
+        sess->funcs[i].probe = NULL;
+    }
+    if(klfer_alloc_bufs(sess, sizeof(struct klfer_log) * MLOGS))
+    {
+        return -ENOBUFS;
+    }
+    sess->b_used = true;
+    return KLFER_OK;
+}
+
+/**
+ * Teardown session
+ * @param[in] *sess Session
+ */
+static void klfer_teardown_session(struct klfer_session *sess)
+{
+    if(!sess->b_used) return;
+    atomic_set(&sess->state, 0);
+    klfer_reset_funcs(sess);
+    klfer_free_bufs(sess);
+    sess->b_used = false;
+}
+
+/**
+ * Attach open file to the named session (create it if it does not exist)
+ * @param[in] *cur  Session which the file is attached currently
+ * @param[in] *name Session name
+ * @return Pointer to the session, or ERR_PTR() on error
+ */
+static struct klfer_session *klfer_attach_session(struct klfer_session *cur, const char *name)
+{
+    struct klfer_session *sess = NULL;
+    int sess_idx, ret;
+
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
+    {
+        if(modData.sessions[sess_idx].b_used)
+        {
+            if(strcmp(modData.sessions[sess_idx].name, name) == 0)
+            {
+                /* self-test / calibration owns its session */
+                if(modData.sessions[sess_idx].b_private) return ERR_PTR(-EBUSY);
+                sess = &modData.sessions[sess_idx];
+                break;
+            }
+        }
+        else if(!sess)
+        {
+            sess = &modData.sessions[sess_idx];
+        }
+    }
+    if(!sess)
+    {
+        pr_err("Too many sessions.\n");
+        return ERR_PTR(-ENOBUFS);
+    }
+    if(!sess->b_used)
+    {
+        ret = klfer_init_session(sess, name);
+        if(ret) return ERR_PTR(ret);
+        pr_info("Create session: %s\n", name);
+    }
+    cur->users--;
+    sess->users++;
+    return sess;
+}
+
+/**
+ * Initialize module data
+ * @retval KLFER_OK Success
+ * @retval -ENOBUFS Failed to kmalloc
+ * @retval -ENOMEM  Failed to allocate stack table
+ */
+static int klfer_init_mod_data(void)
+{
+    int i, ret;
+    modData.pclass = NULL;
+    modData.pdev = NULL;
+    mutex_init(&modData.ctrl_lock);
+    for(i=0; i<MAX_PROBES; i++)
+    {
+        modData.probes[i].refcnt = 0;
+    }
+    for(i=0; i<MAX_SESSIONS; i++)
+    {
+        modData.sessions[i].b_used = false;
+        modData.sessions[i].bufs = NULL;
+    }
+    ret = klfer_stack_init(clamp(STACKS, 0, KLFER_MAX_STACKS));
+    if(ret)
+    {
+        return ret;
+    }
+    /* Files are attached to the default session until another one is selected */
+    ret = klfer_init_session(&modData.sessions[0], DEFAULT_SESSION);
+    if(ret)
+    {
+        klfer_stack_exit();
+    }
+    return ret;
+}
+
+/**
+ * Teardown module data
+ */
+static void klfer_teardown_mod_data(void)
+{
+    int i;
+
+    for(i=0; i<MAX_SESSIONS; i++)
     {
-        pr_err("register_kretprobe() failed. > %s() (returned: %d)\n", cfg->func_name, ret);
-        klfer_unregister_func(cfg);
-        return ret;
+        klfer_teardown_session(&modData.sessions[i]);
     }
-    pr_info("Register return probe at %s: %p\n",
-            modData.funcs[func_idx].krp.kp.symbol_name,
-            modData.funcs[func_idx].krp.kp.addr);
-    return KLFER_OK;
+    /* no handler runs after all probes are unregistered */
+    klfer_stack_exit();
 }
 
 /**
- * Unregister function
- * @param[in] *cfg Configurations for registration
- * @retval  KLFER_OK Success
- * @retval -ESRCH    The function is not registered yet
+ * Empty function probed by calibration
  */
-static int klfer_unregister_func(struct klfer_func_cfg *cfg)
+static noinline void klfer_calib_func(void)
 {
-    int func_idx;
-
-    for(func_idx=0; func_idx<modData.num_of_funcs; func_idx++)
-    {
-        if(modData.funcs[func_idx].b_registered &&
-           strcmp(cfg->func_name, modData.funcs[func_idx].func_name) == 0)
-        {
-            klfer_unregister_kretprobe(func_idx);
-            return KLFER_OK;
-        }
-    }
-    pr_err("Err: %s() is not registered.\n", cfg->func_name);
-    return -ESRCH;
+    /* keep the call */
+    barrier();
 }
 
 /**
- * Unregister all registered functions
+ * Call the empty function on current CPU (by smp_call_function_single())
+ * @param[in] *arg Number of calls (unsigned int)
  */
-static void klfer_reset_funcs(void)
+static void klfer_calib_run(void *arg)
 {
-    int func_idx;
+    unsigned int i, loops = *(unsigned int *)arg;
 
-    for(func_idx=0; func_idx<MAX_REG_FUNCS; func_idx++)
+    for(i=0; i<loops; i++)
     {
-        if(modData.funcs[func_idx].b_registered)
-        {
-            klfer_unregister_kretprobe(func_idx);
-        }
+        klfer_calib_func();
     }
-    modData.num_of_funcs = 0;
 }
 
 /**
- * Set control parameters
- * @param[in] ctrl_param Control parameters
- * @retval KLFER_OK  Success
- * @retval KLFER_ERR Error
+ * Measure probe overhead of the session on each online CPU
+ * The empty function is logged in a private session with the same mode
+ * (timestamp, format, paired-call record and stack capture) and a log stream
+ * large enough not to drop. Its average duration is the overhead added to a
+ * call by the handlers, and is saved per CPU for overhead subtraction.
+ * JIT print log is not measured.
+ * @param[in] *sess    Session
+ * @param[in,out] *cfg Loops / Results
+ * @retval KLFER_OK Success
+ * @retval -EINVAL  loops is 0 or too large
+ * @retval -ENOBUFS No session is available, or failed to allocate
+ * @retval -EIO     The empty function is not probed
+ * @retval <0       Error of registration
  */
-static int klfer_set_params(int ctrl_param)
+static int klfer_calibrate(struct klfer_session *sess, struct klfer_calib_cfg *cfg)
 {
-    /* Logger control */
-    if(ctrl_param & (UPDATE_FLAG << LOGGER_CTRL_SHIFT))
+    struct klfer_session *calib = NULL;
+    struct klfer_func_cfg func_cfg = { .func_name = CALIB_FUNC, .b_reg = true };
+    struct klfer_func_stat *stat;
+    unsigned int loops = cfg->loops;
+    u64 overhead, sum = 0;
+    int sess_idx, cpu, ret;
+
+    if(loops == 0 || loops > CALIB_MAX_LOOPS)
     {
-        if(ctrl_param & (VALUE_BIT << LOGGER_CTRL_SHIFT))
-            modData.b_logging = true;
-        else
-            modData.b_logging = false;
+        return -EINVAL;
     }
-    /* JIT print log control */
-    if(ctrl_param & (UPDATE_FLAG << JIT_CTRL_SHIFT))
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->loops = loops;
+    cfg->min_ns = U64_MAX;
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
     {
-        if(ctrl_param & (VALUE_BIT << JIT_CTRL_SHIFT))
-            modData.b_jit_log = true;
-        else
-            modData.b_jit_log = false;
+        if(!modData.sessions[sess_idx].b_used)
+        {
+            calib = &modData.sessions[sess_idx];
+            break;
+        }
     }
-    /* Timestamp control */
-    if(ctrl_param & (UPDATE_FLAG << TIMESTAMP_CTRL_SHIFT))
+    if(!calib)
     {
-        /* Enable / Disable */
-        if(ctrl_param & (VALUE_BIT << TIMESTAMP_CTRL_SHIFT))
-            modData.b_timestamp = true;
-        else
-            modData.b_timestamp = false;
-
-        /* Format */
-        modData.timestamp_fmt = TS_FMT_MASK(ctrl_param);
+        pr_err("Too many sessions.\n");
+        return -ENOBUFS;
     }
-    return KLFER_OK;
-}
-
-/**
- * Dump current settings and registered functions
- */
-static void klfer_dump_settings(void)
-{
-    int func_idx;
-    char ts_fmt[40];
-
-    switch(modData.timestamp_fmt)
+    ret = klfer_init_session(calib, CALIB_SESSION);
+    if(ret)
     {
-    case TS_FMT_ABS:
-        strcpy(ts_fmt, "Absolute time");
-        break;
-    case TS_FMT_RLTV_FIRST:
-        strcpy(ts_fmt, "Relative time from the first log");
-        break;
-    case TS_FMT_RLTV_PREV:
-        strcpy(ts_fmt, "Relative time from the previous log");
-        break;
-    default:
-        strcpy(ts_fmt, "Unknown format");
-        break;
+        return ret;
     }
+    calib->b_private = true;
+    /* 'e' and 'r' of every call (records are not longer than FIXED ones) */
+    ret = klfer_resize_bufs(calib, sizeof(struct klfer_log) * 2 * (loops + 1));
+    if(ret) goto EXIT;
+    ret = klfer_register_func(calib, &func_cfg);
+    /* symbol of this module is never pending */
+    if(ret == KLFER_REG_PENDING) ret = -ENOENT;
+    if(ret) goto EXIT;
+    calib->stack_rate = sess->stack_rate;
+    atomic_set(&calib->state, (atomic_read(&sess->state) & ~(SESS_F_JIT_LOG | SESS_F_SUBTRACT)) | SESS_F_LOGGING);
 
-    /* Dump parameter settings */
-    printk("Logger        : %s\n", (modData.b_logging ?   "Enable" : "Disable"));
-    printk("JIT print log : %s\n", (modData.b_jit_log ?   "Enable" : "Disable"));
-    printk("Timestamp     : %s\n", (modData.b_timestamp ? "Enable" : "Disable"));
-    printk("Timestamp fmt : %s\n", ts_fmt);
+    for_each_online_cpu(cpu)
+    {
+        /* IRQs are disabled on the CPU, so no interrupt is measured */
+        smp_call_function_single(cpu, klfer_calib_run, &loops, 1);
+    }
+    klfer_quiesce(calib);
 
-    /* Dump registered functions */
-    printk("[Indx] [Reg] function_name\n");
-    for(func_idx=0; func_idx<modData.num_of_funcs; func_idx++)
+    for_each_online_cpu(cpu)
     {
-        printk("[%4d] [ %c ] %s\n", func_idx, (modData.funcs[func_idx].b_registered ? 'Y' : 'N'),
-                modData.funcs[func_idx].func_name);
+        stat = &per_cpu_ptr(calib->bufs, cpu)->stats[0];
+        if(stat->calls == 0) continue;
+        overhead = div64_u64(stat->total_ns, stat->calls);
+        per_cpu_ptr(sess->bufs, cpu)->overhead_ns = overhead;
+        cfg->min_ns = min(cfg->min_ns, overhead);
+        cfg->max_ns = max(cfg->max_ns, overhead);
+        sum += overhead;
+        cfg->num_cpus++;
     }
+    if(cfg->num_cpus == 0)
+    {
+        pr_err("Err: %s() is not probed.\n", CALIB_FUNC);
+        cfg->min_ns = 0;
+        ret = -EIO;
+        goto EXIT;
+    }
+    cfg->avg_ns = div_u64(sum, cfg->num_cpus);
+    pr_info("Overhead of %s: %llu nsec (min %llu / max %llu)\n", sess->name, cfg->avg_ns, cfg->min_ns, cfg->max_ns);
+EXIT:
+    klfer_teardown_session(calib);
+    return ret;
 }
 
+#ifdef DEBUG
 /**
- * Print event log
- * @param[in] log_idx Log index (0 origin)
+ * Self-test of logging path
+ * Runs in a private session. ctrl_lock is taken only for the control operations,
+ * so other sessions can be controlled while the load generator runs.
+ * Target functions called by others during the test are logged to the session
+ * too and may be reported as errors.
+ * @param[in,out] *cfg Loops / Results
+ * @retval KLFER_OK Test is done (see the results)
+ * @retval -EINVAL  loops is 0
+ * @retval -EBUSY   Another self-test is running
+ * @retval -ENOBUFS No session is available, or failed to allocate
+ * @retval <0       Error of registration / load generator
  */
-static void klfer_print_log(int log_idx)
+static int klfer_selftest(struct klfer_selftest_cfg *cfg)
 {
-    char buf[MAX_STR_LEN * 3];
-    int offset = 0;
-    long timestamp;
-    struct klfer_log *log = &modData.logs[log_idx];
-    struct klfer_log *rltv_log = NULL;
+    static DEFINE_MUTEX(selftest_lock);
+    struct klfer_session *sess = NULL;
+    struct klfer_func_cfg func_cfg = { .b_reg = true };
+    struct klfer_stats *stats;
+    const char *funcs[] = { "klfer_stress_func", "klfer_stress_nested_func" };
+    unsigned long missed[ARRAY_SIZE(funcs)];
+    unsigned int loops = cfg->loops;
+    u64 calls, hist_calls;
+    int sess_idx, func_idx, ctrl_param = 0, ret, i;
 
-    if(modData.b_timestamp)
+    if(loops == 0)
+    {
+        return -EINVAL;
+    }
+    stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+    if(!stats)
     {
-        timestamp = log->time.tv_sec * NSEC_PER_SEC + log->time.tv_nsec;
-        switch(modData.timestamp_fmt)
+        return -ENOBUFS;
+    }
+    /* load generator is shared */
+    if(!mutex_trylock(&selftest_lock))
+    {
+        kfree(stats);
+        return -EBUSY;
+    }
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->loops = loops;
+    mutex_lock(&modData.ctrl_lock);
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
+    {
+        if(!modData.sessions[sess_idx].b_used)
         {
-        case TS_FMT_RLTV_FIRST:
-            rltv_log = &modData.logs[0];
-            break;
-        case TS_FMT_RLTV_PREV:
-            if(log_idx > 0) rltv_log = &modData.logs[log_idx - 1];
-            else rltv_log = &modData.logs[0];
-            break;
-        default:
+            sess = &modData.sessions[sess_idx];
             break;
         }
-        if(rltv_log)
-            timestamp -= rltv_log->time.tv_sec * NSEC_PER_SEC + rltv_log->time.tv_nsec;
-        offset = snprintf(buf, 32, "[ %20ld nsec] ", timestamp);
     }
-    snprintf(buf + offset, MAX_STR_LEN * 3 - offset, "[%d] %c %s",
-             log_idx + 1,
-             log->event_id,
-             modData.funcs[log->func_idx].func_name);
-    printk("%s\n", buf);
+    if(!sess)
+    {
+        pr_err("Too many sessions.\n");
+        ret = -ENOBUFS;
+        goto UNLOCK;
+    }
+    ret = klfer_init_session(sess, SELFTEST_SESSION);
+    if(ret) goto UNLOCK;
+    sess->b_private = true;
+    for(func_idx=0; func_idx<ARRAY_SIZE(funcs); func_idx++)
+    {
+        strcpy(func_cfg.func_name, funcs[func_idx]);
+        ret = klfer_register_func(sess, &func_cfg);
+        if(ret) goto EXIT;
+    }
+
+    /* Steady phase: every call is logged or counted as dropped */
+    ENABLE_LOGGER(ctrl_param);
+    klfer_set_params(sess, ctrl_param);
+    mutex_unlock(&modData.ctrl_lock);
+    ret = klfer_stress_start(cfg->loops);
+    if(ret < 0) goto RELOCK;
+    cfg->num_threads = ret;
+    while(klfer_stress_running())
+    {
+        msleep(10);
+    }
+    klfer_stress_stop();
+    mutex_lock(&modData.ctrl_lock);
+    klfer_quiesce(sess);
+    for(func_idx=0; func_idx<ARRAY_SIZE(funcs); func_idx++)
+    {
+        missed[func_idx] = sess->funcs[func_idx].probe->krp.nmissed;
+    }
+    klfer_selftest_check(sess, true, cfg);
+    /* klfer_stress_func() calls klfer_stress_nested_func() 5 times */
+    klfer_get_stats(sess, stats);
+    for(func_idx=0; func_idx<ARRAY_SIZE(funcs); func_idx++)
+    {
+        calls = (u64)cfg->loops * cfg->num_threads * (func_idx ? 5 : 1) - missed[func_idx];
+        cfg->expected += calls * 2;
+        hist_calls = 0;
+        for(i=0; i<KLFER_HIST_BUCKETS; i++)
+        {
+            hist_calls += stats->funcs[func_idx].hist[i];
+        }
+        if(stats->funcs[func_idx].calls != calls || hist_calls != calls)
+        {
+            pr_err("selftest: %s() returned %llu times, %llu in histogram (expected %llu)\n",
+                   funcs[func_idx], stats->funcs[func_idx].calls, hist_calls, calls);
+            cfg->miscounts++;
+        }
+    }
+    if(cfg->records + cfg->dropped != cfg->expected)
+    {
+        pr_err("selftest: %llu logged + %llu dropped (expected %llu)\n",
+               cfg->records, cfg->dropped, cfg->expected);
+        cfg->miscounts++;
+    }
+
+    /* Churn phase: control operations race with the handlers */
+    klfer_reset_logs(sess);
+    ctrl_param = 0;
+    ENABLE_LOGGER(ctrl_param);
+    klfer_set_params(sess, ctrl_param);
+    mutex_unlock(&modData.ctrl_lock);
+    ret = klfer_stress_start(cfg->loops);
+    if(ret < 0) goto RELOCK;
+    while(klfer_stress_running())
+    {
+        mutex_lock(&modData.ctrl_lock);
+        klfer_selftest_toggle(sess, cfg->toggles++);
+        mutex_unlock(&modData.ctrl_lock);
+        usleep_range(100, 200);
+    }
+    klfer_stress_stop();
+    mutex_lock(&modData.ctrl_lock);
+    klfer_quiesce(sess);
+    klfer_selftest_check(sess, false, cfg);
+    ret = KLFER_OK;
+    pr_info("selftest: %u CPUs, %llu / %llu logs, %u toggles, %u broken, %u unpaired, %u miscounts\n",
+            cfg->num_threads, cfg->records, cfg->expected, cfg->toggles,
+            cfg->broken, cfg->unpaired, cfg->miscounts);
+    goto EXIT;
+RELOCK:
+    mutex_lock(&modData.ctrl_lock);
+EXIT:
+    klfer_teardown_session(sess);
+UNLOCK:
+    mutex_unlock(&modData.ctrl_lock);
+    mutex_unlock(&selftest_lock);
+    kfree(stats);
+    return ret;
 }
 
 /**
- * Initialize module data
- * @retval KLFER_OK Success
- * @retval -ENOBUFS Failed to kmalloc
+ * Control operation of churn phase
+ * JIT print log is not toggled (printk of every record floods the console).
+ * @param[in] *sess Session
+ * @param[in] step  Number of operations done so far
  */
-static int klfer_init_mod_data(void)
+static void klfer_selftest_toggle(struct klfer_session *sess, unsigned int step)
 {
-    int i;
-    modData.pclass = NULL;
-    modData.pdev = NULL;
-    atomic_set(&modData.open_available, 1);
-    modData.num_of_funcs = 0;
-    modData.num_of_logs = 0;
-    modData.b_logging = false;
-    modData.b_jit_log = false;
-    modData.b_timestamp = true;
-    modData.timestamp_fmt = TS_FMT_ABS;
-    for(i=0; i<MAX_REG_FUNCS; i++)
-    {
-        modData.funcs[i].b_registered = false;
-    }
-    modData.logs = (struct klfer_log *)kmalloc(sizeof(struct klfer_log) * MLOGS, GFP_KERNEL);
-    if(!modData.logs)
+    struct klfer_func_cfg func_cfg = { .func_name = "klfer_stress_nested_func" };
+    int ctrl_param = 0;
+
+    switch(step % 8)
     {
-        return -ENOBUFS;
+    case 0: DISABLE_LOGGER(ctrl_param); break;
+    case 1: ENABLE_LOGGER(ctrl_param);  break;
+    case 2: ENABLE_PAIRED(ctrl_param);  break;
+    case 3: DISABLE_TS(ctrl_param);     break;
+    case 4:
+        /* logs are deleted with the running handlers stopped */
+        if(atomic_read(&sess->state) & SESS_F_COMPACT)
+            DISABLE_COMPACT(ctrl_param);
+        else
+            ENABLE_COMPACT(ctrl_param);
+        break;
+    case 5: ENABLE_TS(ctrl_param);      break;
+    case 6:
+        DISABLE_PAIRED(ctrl_param);
+        WRITE_ONCE(sess->stack_rate, sess->stack_rate ? 0 : 1);
+        break;
+    default:
+        func_cfg.b_reg = !sess->funcs[1].b_registered;
+        if(func_cfg.b_reg)
+            klfer_register_func(sess, &func_cfg);
+        else
+            klfer_unregister_func(sess, &func_cfg);
+        return;
     }
-
-    return KLFER_OK;
+    klfer_set_params(sess, ctrl_param);
 }
 
 /**
- * Teardown module data
+ * Check log streams of self-test (handlers are stopped)
+ *   Both phases : Every record is decoded, function / event ID are valid,
+ *                 timestamps do not go back and stacks exist.
+ *   Steady phase: Entries and returns are nested correctly on each CPU
+ *                 (the stream may end in a call if later records are dropped).
+ * @param[in] *sess     Session
+ * @param[in] b_steady  true: Steady phase / false: Churn phase
+ * @param[in,out] *cfg  Results
  */
-static void klfer_teardown_mod_data(void)
+static void klfer_selftest_check(struct klfer_session *sess, bool b_steady, struct klfer_selftest_cfg *cfg)
 {
-    klfer_reset_funcs();
-    if(modData.logs)
+    struct klfer_cpu_buf *buf;
+    struct klfer_cursor cur;
+    struct klfer_event ev;
+    struct klfer_stack_cfg stack_cfg;
+    int open[2];
+    int fmt = (atomic_read(&sess->state) & SESS_F_COMPACT) ? KLFER_FMT_COMPACT : KLFER_FMT_FIXED;
+    int cpu, depth, ret;
+    u64 prev_time;
+
+    for_each_possible_cpu(cpu)
     {
-        kfree(modData.logs);
+        buf = per_cpu_ptr(sess->bufs, cpu);
+        klfer_cursor_init(&cur, buf->data, buf->head, 0, fmt, cpu);
+        depth = 0;
+        prev_time = 0;
+        while((ret = klfer_next_event(&cur, &ev)) > 0)
+        {
+            if(b_steady)
+                cfg->records++;
+            else
+                cfg->churn_records++;
+            if(ev.func_idx >= sess->num_of_funcs || !ev.event_id || !strchr(b_steady ? "er" : "erp", ev.event_id) ||
+               (ev.time && ev.time < prev_time))
+            {
+                pr_err("selftest: broken log on cpu%d at %llu\n", cpu, cur.pos);
+                cfg->broken++;
+                continue;
+            }
+            if(ev.time) prev_time = ev.time;
+            if(ev.stack_id)
+            {
+                stack_cfg.stack_id = ev.stack_id;
+                if(klfer_stack_get(&stack_cfg))
+                {
+                    pr_err("selftest: unknown stack %u on cpu%d\n", ev.stack_id, cpu);
+                    cfg->broken++;
+                }
+            }
+            if(!b_steady) continue;
+            if(ev.event_id == 'e')
+            {
+                if(depth == ARRAY_SIZE(open))
+                    cfg->unpaired++;
+                else
+                    open[depth++] = ev.func_idx;
+            }
+            else if(depth > 0 && open[depth - 1] == ev.func_idx)
+            {
+                depth--;
+            }
+            else
+            {
+                pr_err("selftest: return without entry on cpu%d at %llu\n", cpu, cur.pos);
+                cfg->unpaired++;
+            }
+        }
+        if(ret < 0)
+        {
+            pr_err("selftest: broken log on cpu%d at %llu\n", cpu, cur.pos);
+            cfg->broken++;
+        }
+        if(b_steady)
+        {
+            if(depth && !buf->dropped) cfg->unpaired++;
+            cfg->dropped += buf->dropped;
+        }
     }
 }
+#endif
 
 /**
  * Open klfer device file
  * @param[in] *ind  Not use
- * @param[in] *filp Not use
+ * @param[in] *filp Device file (attached to the default session)
  * @retval KLFER_OK Success
- * @retval -EBUSY   Device file is open already
  */
 static int klfer_open(struct inode *ind, struct file *filp)
 {
-    if(!atomic_dec_and_test(&modData.open_available))
-    {
-        atomic_inc(&modData.open_available);
-        pr_err("klfer is open already.\n");
-        return -EBUSY;
-    }
+    mutex_lock(&modData.ctrl_lock);
+    modData.sessions[0].users++;
+    filp->private_data = &modData.sessions[0];
+    mutex_unlock(&modData.ctrl_lock);
     pr_debug("Open klfer.\n");
     return KLFER_OK;
 }
@@ -431,19 +2140,23 @@ static int klfer_open(struct inode *ind, struct file *filp)
 /**
  * Close klfer device file
  * @param[in] *ind  Not use
- * @param[in] *filp Not use
+ * @param[in] *filp Device file
  * @retval KLFER_OK Success
  */
 static int klfer_close(struct inode *ind, struct file *filp)
 {
-    atomic_inc(&modData.open_available);
+    struct klfer_session *sess = filp->private_data;
+
+    mutex_lock(&modData.ctrl_lock);
+    sess->users--;
+    mutex_unlock(&modData.ctrl_lock);
     pr_debug("Close klfer.\n");
     return KLFER_OK;
 }
 
 /**
  * Handler for ioctl
- * @param[in] *filp Not use
+ * @param[in] *filp Device file (private_data is the attached session)
  * @param[in] cmd   Request command
  * @param[in] arg   Argument pointer in user space
  * @retval KLFER_OK Success
@@ -452,47 +2165,156 @@ static int klfer_close(struct inode *ind, struct file *filp)
  */
 static long klfer_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    struct klfer_session *sess;
     struct klfer_func_cfg func_cfg;
+    struct klfer_session_cfg sess_cfg;
+    struct klfer_info info;
+    struct klfer_read_cfg read_cfg;
+    struct klfer_stats *stats;
+    struct klfer_stack_cfg stack_cfg;
+    struct klfer_arm_cfg arm_cfg;
+    struct klfer_calib_cfg calib_cfg;
+#ifdef DEBUG
+    struct klfer_selftest_cfg selftest_cfg;
+#endif
+    __u64 buf_size;
+    __u32 stack_rate;
     int ctrl_param;
     int ret = KLFER_OK;
     int err;
 
     pr_debug("ioctl command: %d\n", _IOC_NR(cmd));
+    mutex_lock(&modData.ctrl_lock);
+    sess = filp->private_data;
     switch(_IOC_NR(cmd))
     {
     case KLFER_REG_FUNC_FLAG:
         err = copy_from_user(&func_cfg, (void *)arg, sizeof(func_cfg));
         if(err) goto ERR_COPY_FROM_USER;
+        func_cfg.func_name[MAX_STR_LEN - 1] = '\0';
+        func_cfg.path[MAX_PATH_LEN - 1] = '\0';
         if(func_cfg.b_reg)
-            ret = klfer_register_func(&func_cfg);
+            ret = klfer_register_func(sess, &func_cfg);
         else
-            ret = klfer_unregister_func(&func_cfg);
+            ret = klfer_unregister_func(sess, &func_cfg);
         break;
     case KLFER_RESET_FLAG:
-        klfer_reset_funcs();
-        modData.num_of_logs = 0;
+        klfer_reset_funcs(sess);
+        klfer_reset_logs(sess);
+        /* A named session disappears on reset unless other files use it */
+        if(sess != &modData.sessions[0] && sess->users == 1)
+        {
+            pr_info("Delete session: %s\n", sess->name);
+            klfer_teardown_session(sess);
+            sess->users = 0;
+            modData.sessions[0].users++;
+            filp->private_data = &modData.sessions[0];
+        }
         break;
     case KLFER_SET_PARAMS_FLAG:
         err = copy_from_user(&ctrl_param, (void *)arg, sizeof(ctrl_param));
         if(err) goto ERR_COPY_FROM_USER;
-        ret = klfer_set_params(ctrl_param);
+        ret = klfer_set_params(sess, ctrl_param);
         break;
     case KLFER_DUMP_SETTINGS_FLAG:
-        klfer_dump_settings();
+        klfer_dump_settings(sess);
         break;
     case KLFER_DUMP_LOGS_FLAG:
-        klfer_dump_logs(0, modData.num_of_logs);
+        klfer_dump_logs(sess);
+        break;
+    case KLFER_GET_INFO_FLAG:
+        klfer_get_info(sess, &info);
+        err = copy_to_user((void *)arg, &info, sizeof(info));
+        if(err) goto ERR_COPY_FROM_USER;
+        break;
+    case KLFER_READ_LOGS_FLAG:
+        err = copy_from_user(&read_cfg, (void *)arg, sizeof(read_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        ret = klfer_read_logs(sess, &read_cfg);
+        if(ret) break;
+        err = copy_to_user((void *)arg, &read_cfg, sizeof(read_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        break;
+    case KLFER_RESIZE_BUF_FLAG:
+        err = copy_from_user(&buf_size, (void *)arg, sizeof(buf_size));
+        if(err) goto ERR_COPY_FROM_USER;
+        if(buf_size > SIZE_MAX)
+            ret = -EINVAL;
+        else
+            ret = klfer_resize_bufs(sess, buf_size);
+        break;
+    case KLFER_GET_STATS_FLAG:
+        /* too large for the stack with histograms */
+        stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+        if(!stats)
+        {
+            ret = -ENOBUFS;
+            break;
+        }
+        klfer_get_stats(sess, stats);
+        err = copy_to_user((void *)arg, stats, sizeof(*stats));
+        kfree(stats);
+        if(err) goto ERR_COPY_FROM_USER;
+        break;
+    case KLFER_SET_STACK_FLAG:
+        err = copy_from_user(&stack_rate, (void *)arg, sizeof(stack_rate));
+        if(err) goto ERR_COPY_FROM_USER;
+        WRITE_ONCE(sess->stack_rate, stack_rate);
+        break;
+    case KLFER_GET_STACK_FLAG:
+        err = copy_from_user(&stack_cfg, (void *)arg, sizeof(stack_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        ret = klfer_stack_get(&stack_cfg);
+        if(ret) break;
+        err = copy_to_user((void *)arg, &stack_cfg, sizeof(stack_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        break;
+    case KLFER_ARM_FUNCS_FLAG:
+        err = copy_from_user(&arm_cfg, (void *)arg, sizeof(arm_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        ret = klfer_arm_funcs(sess, &arm_cfg);
+        break;
+    case KLFER_CALIBRATE_FLAG:
+        err = copy_from_user(&calib_cfg, (void *)arg, sizeof(calib_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        ret = klfer_calibrate(sess, &calib_cfg);
+        if(ret) break;
+        err = copy_to_user((void *)arg, &calib_cfg, sizeof(calib_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        break;
+    case KLFER_SET_SESSION_FLAG:
+        err = copy_from_user(&sess_cfg, (void *)arg, sizeof(sess_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        sess_cfg.name[MAX_STR_LEN - 1] = '\0';
+        sess = klfer_attach_session(sess, sess_cfg.name);
+        if(IS_ERR(sess))
+            ret = PTR_ERR(sess);
+        else
+            filp->private_data = sess;
         break;
 #ifdef DEBUG
     case KLFER_SAMPLE_FLAG:
         klfer_sample_func();
         break;
+    case KLFER_SELFTEST_FLAG:
+        err = copy_from_user(&selftest_cfg, (void *)arg, sizeof(selftest_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        /* self-test takes ctrl_lock only for its control operations */
+        mutex_unlock(&modData.ctrl_lock);
+        ret = klfer_selftest(&selftest_cfg);
+        mutex_lock(&modData.ctrl_lock);
+        if(ret) break;
+        err = copy_to_user((void *)arg, &selftest_cfg, sizeof(selftest_cfg));
+        if(err) goto ERR_COPY_FROM_USER;
+        break;
 #endif
     default:
         ret = -EINVAL;
     }
+    mutex_unlock(&modData.ctrl_lock);
     return ret;
 ERR_COPY_FROM_USER:
+    mutex_unlock(&modData.ctrl_lock);
     return -EFAULT;
 }
 
@@ -558,6 +2380,161 @@ static void klfer_delete_dev(void)
     unregister_chrdev_region(dev_no, MINOR_NUM);
 }
 
+/**
+ * Arm pending functions (called when a module is coming)
+ * @param[in] *mod Coming module
+ */
+static void klfer_arm_pending(struct module *mod)
+{
+    struct klfer_session *sess;
+    int sess_idx, func_idx;
+
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
+    {
+        sess = &modData.sessions[sess_idx];
+        if(!sess->b_used) continue;
+        for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+        {
+            /* armed only by its own module */
+            if(!sess->funcs[func_idx].b_pending ||
+               strcmp(sess->funcs[func_idx].pending_mod, mod->name) != 0) continue;
+            if(klfer_arm_func(sess, func_idx) == KLFER_OK)
+            {
+                pr_info("Arm pending function %s (%s)\n", sess->funcs[func_idx].func_name, sess->name);
+            }
+        }
+    }
+}
+
+/**
+ * Unregister kretprobes whose code is going away
+ * @param[in] *mod       Module
+ * @param[in] b_init_only true: only .init text (module is live), false: whole module (module is going)
+ */
+static void klfer_disarm_module(struct module *mod, bool b_init_only)
+{
+    struct klfer_session *sess;
+    struct klfer_probe *probe;
+    unsigned long addr;
+    int sess_idx, func_idx;
+
+    for(sess_idx=0; sess_idx<MAX_SESSIONS; sess_idx++)
+    {
+        sess = &modData.sessions[sess_idx];
+        if(!sess->b_used) continue;
+        for(func_idx=0; func_idx<sess->num_of_funcs; func_idx++)
+        {
+            probe = sess->funcs[func_idx].probe;
+            if(!sess->funcs[func_idx].b_registered || probe->b_user) continue;
+            addr = (unsigned long)probe->krp.kp.addr;
+            if(b_init_only ? !within_module_init(addr, mod) : !within_module(addr, mod)) continue;
+            klfer_unregister_kretprobe(sess, func_idx);
+            /* armed again when the module is reloaded */
+            sess->funcs[func_idx].b_pending = !b_init_only;
+            strlcpy(sess->funcs[func_idx].pending_mod, mod->name, MODULE_NAME_LEN);
+            pr_info("Disarm function %s in %s (%s)\n", sess->funcs[func_idx].func_name, mod->name, sess->name);
+        }
+    }
+}
+
+/**
+ * Module notifier callback
+ * @param[in] *nb   Not used
+ * @param[in] val   Module state
+ * @param[in] *data Module
+ * @retval NOTIFY_DONE Always
+ */
+static int klfer_module_notify(struct notifier_block *nb, unsigned long val, void *data)
+{
+    struct module *mod = data;
+
+    mutex_lock(&modData.ctrl_lock);
+    switch(val)
+    {
+    case MODULE_STATE_COMING:
+        klfer_arm_pending(mod);
+        break;
+    case MODULE_STATE_LIVE:
+        /* .init text is freed after the module is initialized */
+        klfer_disarm_module(mod, true);
+        break;
+    case MODULE_STATE_GOING:
+        klfer_disarm_module(mod, false);
+        break;
+    default:
+        break;
+    }
+    mutex_unlock(&modData.ctrl_lock);
+    return NOTIFY_DONE;
+}
+
+/**
+ * Register functions listed in text to the default session
+ * @param[in] *list Function names separated by new line ('#': comment)
+ */
+static void klfer_register_list(char *list)
+{
+    struct klfer_func_cfg cfg;
+    char *line, *name;
+
+    while((line = strsep(&list, "\n")) != NULL)
+    {
+        name = strim(line);
+        if(*name == '\0' || *name == '#') continue;
+        if(strlen(name) >= MAX_STR_LEN)
+        {
+            pr_err("Err: too long function name %s\n", name);
+            continue;
+        }
+        strcpy(cfg.func_name, name);
+        cfg.b_reg = true;
+        cfg.threshold_ns = 0;
+        cfg.path[0] = '\0';
+        cfg.quota_pct = 0;
+        klfer_register_func(&modData.sessions[0], &cfg);
+    }
+}
+
+/**
+ * Register functions given by module parameters (FUNCS, FUNCS_FILE)
+ */
+static void klfer_load_probe_list(void)
+{
+    const struct firmware *fw;
+    char *list;
+    int i, ctrl_param = 0;
+
+    mutex_lock(&modData.ctrl_lock);
+    if(LOGGER)
+    {
+        /* enable first, so that each probe logs as soon as it is armed */
+        ENABLE_LOGGER(ctrl_param);
+        klfer_set_params(&modData.sessions[0], ctrl_param);
+    }
+    for(i=0; i<NFUNCS; i++)
+    {
+        klfer_register_list(FUNCS[i]);
+    }
+    if(FUNCS_FILE)
+    {
+        if(request_firmware(&fw, FUNCS_FILE, modData.pdev) == 0)
+        {
+            list = kmemdup_nul((const char *)fw->data, fw->size, GFP_KERNEL);
+            if(list)
+            {
+                klfer_register_list(list);
+                kfree(list);
+            }
+            release_firmware(fw);
+        }
+        else
+        {
+            pr_err("Err: failed to load %s\n", FUNCS_FILE);
+        }
+    }
+    mutex_unlock(&modData.ctrl_lock);
+}
+
 /**
  * Handler when insmod
  * @retval KLFER_OK  Success
@@ -574,6 +2551,13 @@ static int __init klfer_init(void)
         klfer_teardown_mod_data();
         return KLFER_ERR;
     }
+    if(register_module_notifier(&klfer_module_nb))
+    {
+        klfer_delete_dev();
+        klfer_teardown_mod_data();
+        return KLFER_ERR;
+    }
+    klfer_load_probe_list();
     pr_info(KLFER_MOD_NAME "-" KLFER_MOD_VERSION ": loaded.\n");
     return KLFER_OK;
 }
@@ -583,6 +2567,7 @@ static int __init klfer_init(void)
  */
 static void __exit klfer_exit(void)
 {
+    unregister_module_notifier(&klfer_module_nb);
     klfer_teardown_mod_data();
     klfer_delete_dev();
     pr_info(KLFER_MOD_NAME "-" KLFER_MOD_VERSION ": unloaded.\n");
@@ -594,4 +2579,3 @@ module_exit(klfer_exit);
 MODULE_DESCRIPTION("KLFER (Kernel Logger for Function Entries and Returns)");
 MODULE_LICENSE("GPL v2");
 MODULE_VERSION(KLFER_MOD_VERSION);
-
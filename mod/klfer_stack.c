@@ -0,0 +1,159 @@
+/**
+ * @file  klfer_stack.c
+ * @brief Stack trace table of KLFER (shared by all sessions)
+ *
+ * Each unique stack trace is stored once and records carry only its ID.
+ * Stacks are never deleted while the module is loaded, so lookup walks the
+ * hash chains without lock and only insertion takes stack_lock.
+ */
+
+#include "klfer.h"
+#include "klfer_stack.h"
+
+#define STACK_HASH_BITS    10
+#define STACK_HASH_SIZE    (1 << STACK_HASH_BITS)
+
+struct klfer_stack
+{
+    u32                   hash;
+    u32                   next;        // Next stack ID in the same hash chain (0: end)
+    unsigned int          nr_entries;
+    unsigned long         entries[KLFER_STACK_DEPTH];
+};
+
+static struct klfer_stack *stacks;     // stacks[0] is not used (ID 0: no stack)
+static unsigned int max_stacks;
+static unsigned int num_stacks = 1;    // Next ID (published with smp_store_release)
+static u32 stack_hash[STACK_HASH_SIZE]; // Head ID of each hash chain
+static unsigned int stack_overflow;    // Number of stacks not stored for lack of space
+static DEFINE_RAW_SPINLOCK(stack_lock);
+
+/**
+ * Allocate stack table
+ * @param[in] max Max number of unique stacks
+ * @retval KLFER_OK Success
+ * @retval -ENOMEM  Failed to vmalloc
+ */
+int klfer_stack_init(unsigned int max)
+{
+    stacks = vzalloc(sizeof(*stacks) * (max + 1));
+    if(!stacks)
+    {
+        pr_err("Err: failed to allocate stack table (%u stacks)\n", max);
+        return -ENOMEM;
+    }
+    max_stacks = max;
+    return KLFER_OK;
+}
+
+/**
+ * Free stack table (no handler is running)
+ */
+void klfer_stack_exit(void)
+{
+    vfree(stacks);
+    stacks = NULL;
+}
+
+/**
+ * Search stack in the hash chain
+ * @param[in] hash        Hash of the stack
+ * @param[in] *entries    Return addresses
+ * @param[in] nr_entries  Number of return addresses
+ * @return Stack ID (0: not found)
+ */
+static u32 klfer_stack_find(u32 hash, const unsigned long *entries, unsigned int nr_entries)
+{
+    struct klfer_stack *stack;
+    u32 id;
+
+    for(id = smp_load_acquire(&stack_hash[hash & (STACK_HASH_SIZE - 1)]); id; id = stack->next)
+    {
+        stack = &stacks[id];
+        if(stack->hash == hash && stack->nr_entries == nr_entries &&
+           memcmp(stack->entries, entries, sizeof(*entries) * nr_entries) == 0)
+        {
+            return id;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get ID of stack (stored if it is new)
+ * Called by handlers in any context.
+ * @param[in] *entries    Return addresses
+ * @param[in] nr_entries  Number of return addresses (<= KLFER_STACK_DEPTH)
+ * @return Stack ID (0: table is full)
+ */
+u32 klfer_stack_intern(const unsigned long *entries, unsigned int nr_entries)
+{
+    struct klfer_stack *stack;
+    unsigned long flags;
+    u32 hash, id;
+
+    hash = jhash2((const u32 *)entries, nr_entries * sizeof(*entries) / sizeof(u32), nr_entries);
+    id = klfer_stack_find(hash, entries, nr_entries);
+    if(id) return id;
+
+    raw_spin_lock_irqsave(&stack_lock, flags);
+    /* another CPU may have stored the same stack */
+    id = klfer_stack_find(hash, entries, nr_entries);
+    if(!id)
+    {
+        if(num_stacks > max_stacks)
+        {
+            stack_overflow++;
+        }
+        else
+        {
+            id = num_stacks;
+            stack = &stacks[id];
+            stack->hash = hash;
+            stack->nr_entries = nr_entries;
+            memcpy(stack->entries, entries, sizeof(*entries) * nr_entries);
+            stack->next = stack_hash[hash & (STACK_HASH_SIZE - 1)];
+            smp_store_release(&stack_hash[hash & (STACK_HASH_SIZE - 1)], id);
+            smp_store_release(&num_stacks, id + 1);
+        }
+    }
+    raw_spin_unlock_irqrestore(&stack_lock, flags);
+    return id;
+}
+
+/**
+ * Get stack for the application
+ * @param[in,out] *cfg stack_id is given, and entries are returned
+ * @retval KLFER_OK Success
+ * @retval -ENOENT  No such stack
+ */
+int klfer_stack_get(struct klfer_stack_cfg *cfg)
+{
+    struct klfer_stack *stack;
+    unsigned int i;
+
+    if(cfg->stack_id == 0 || cfg->stack_id >= smp_load_acquire(&num_stacks))
+    {
+        return -ENOENT;
+    }
+    stack = &stacks[cfg->stack_id];
+    cfg->nr_entries = stack->nr_entries;
+    for(i=0; i<stack->nr_entries; i++)
+    {
+        cfg->entries[i] = stack->entries[i];
+    }
+    return KLFER_OK;
+}
+
+/**
+ * Usage of stack table
+ * @param[out] *num      Number of stored stacks
+ * @param[out] *max      Max number of stacks
+ * @param[out] *overflow Number of stacks not stored for lack of space
+ */
+void klfer_stack_usage(unsigned int *num, unsigned int *max, unsigned int *overflow)
+{
+    *num = smp_load_acquire(&num_stacks) - 1;
+    *max = max_stacks;
+    *overflow = READ_ONCE(stack_overflow);
+}
@@ -0,0 +1,10 @@
+#ifndef _KLFER_STACK_H_
+#define _KLFER_STACK_H_
+
+int  klfer_stack_init(unsigned int);
+void klfer_stack_exit(void);
+u32  klfer_stack_intern(const unsigned long *, unsigned int);
+int  klfer_stack_get(struct klfer_stack_cfg *);
+void klfer_stack_usage(unsigned int *, unsigned int *, unsigned int *);
+
+#endif /* _KLFER_STACK_H_ */